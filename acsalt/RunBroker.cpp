@@ -0,0 +1,18 @@
+#include "pch.h"
+
+#include "broker.h"
+#include "exception_strm.h"
+#include "logging.h"
+
+// rundll32.exe acsalt.dll,RunBroker
+void CALLBACK RunBrokerW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR /*lpszCmdLine*/, int /*nCmdShow*/)
+{
+    try
+    {
+        broker::run();
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERROR << L"Exception: " << exc;
+    }
+}
@@ -0,0 +1,31 @@
+#include "pch.h"
+
+#include "batch.h"
+#include "exception_strm.h"
+#include "logging.h"
+
+// rundll32.exe acsalt.dll,RunDigest [/j threads] [/fd sha256] files...
+void CALLBACK RunDigestW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR lpszCmdLine, int /*nCmdShow*/)
+{
+    // rundll32 is a GUI process, report to the console it was started from.
+    if (::AttachConsole(ATTACH_PARENT_PROCESS))
+    {
+        FILE* stream = nullptr;
+        ::_wfreopen_s(&stream, L"CONOUT$", L"w", stdout);
+        ::_wfreopen_s(&stream, L"CONOUT$", L"w", stderr);
+    }
+
+    try
+    {
+        const auto failed = batch::digest(batch::parse_command_line(lpszCmdLine));
+        logging::flush();
+        ::ExitProcess(failed ? 1 : 0);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERROR << L"Exception: " << exc;
+    }
+
+    logging::flush();
+    ::ExitProcess(2);
+}
@@ -0,0 +1,30 @@
+#include "pch.h"
+
+#include "batch.h"
+#include "exception_strm.h"
+#include "logging.h"
+
+// rundll32.exe acsalt.dll,RunSign [/j threads] [/fd sha256] [/tr url]... /dmdf metadata.json files...
+void CALLBACK RunSignW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR lpszCmdLine, int /*nCmdShow*/)
+{
+    // rundll32 is a GUI process, report to the console it was started from.
+    if (::AttachConsole(ATTACH_PARENT_PROCESS))
+    {
+        FILE* stream = nullptr;
+        ::_wfreopen_s(&stream, L"CONOUT$", L"w", stderr);
+    }
+
+    try
+    {
+        const auto failed = batch::run(batch::parse_command_line(lpszCmdLine));
+        logging::flush();
+        ::ExitProcess(failed ? 1 : 0);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_ERROR << L"Exception: " << exc;
+    }
+
+    logging::flush();
+    ::ExitProcess(2);
+}
@@ -2,127 +2,135 @@
 
 #include "acs.h"
 
+#include "admission_gate.h"
 #include "encoder.h"
+#include "endpoint_health.h"
 #include "exception_strm.h"
-#include "file.h"
 #include "http_client.h"
+#include "logging.h"
+#include "poll_scheduler.h"
+#include "scoped_cleanup.h"
+#include "trace.h"
 
-namespace
-{
-    static boost::interprocess::managed_windows_shared_memory managed_shm{ boost::interprocess::open_or_create, "shm", 1024 };
-    static boost::interprocess::interprocess_recursive_mutex* ip_mutex = managed_shm.find_or_construct<boost::interprocess::interprocess_recursive_mutex>("mtx")();
-    const std::wstring API_VERSION = L"2022-06-15-preview";
-}
-
-acs::acs(const std::wstring& tenant, const std::wstring& client_id, const std::wstring& client_secret) :
-    client_(),
-    tenant_(tenant),
-    client_id_(client_id),
-    client_secret_(client_secret),
-    token_(),
-    token_file_(4096, 0)
-{
-    auto size = ::ExpandEnvironmentStringsW(L"%USERPROFILE%\\.acsalt", &token_file_[0], static_cast<DWORD>(token_file_.size()));
-    token_file_.resize(size);
+#include <winhttp.h>
 
-    token_ = load_token();
-}
-
-void acs::login()
+namespace
 {
-    boost::lock_guard<boost::interprocess::interprocess_recursive_mutex> grd(*ip_mutex);
+    // Retries for throttled (429) and failed (5xx) requests. Unlike 401 these don't call for a new token.
+    const unsigned transient_retries = 3;
 
-    std::wclog << L"Logging in tenant: " << tenant_ << L" client id: " << client_id_ << std::endl;
-
-    http_client::header_map headers;
-    headers[L"Content-Type"] = L"application/x-www-form-urlencoded";
+    bool is_transient(DWORD status_code)
+    {
+        return status_code == 429 || status_code >= 500;
+    }
 
-    static const auto scope = encoder::url_encode(L"api://cf2ab426-f71a-4b61-bb8a-9e505b85bc2e//.default");
+    DWORD retry_delay(const http_client::response& resp, unsigned attempt)
+    {
+        std::chrono::milliseconds delay(0);
+        if (http_client::retry_after(resp, delay))
+        {
+            return static_cast<DWORD>(delay.count());
+        }
 
-    std::wostringstream body;
-    body << L"client_id=" << encoder::url_encode(client_id_)
-        << L"&grant_type=client_credentials"
-        << L"&client_info=1"
-        << L"&client_secret=" << encoder::url_encode(client_secret_)
-        << L"&scope=" << scope;
+        return 1000u << attempt;
+    }
 
-    const std::wstring url = L"https://login.microsoftonline.com/" + tenant_ + L"/oauth2/v2.0/token";
+    // Enough for a poll response with the signature and a certificate chain, bigger ones continue on the heap.
+    const std::size_t json_arena_size = 16 * 1024;
 
-    auto resp = client_.post(url, encoder::to_string(body.str()), headers, 2);
-    if (resp.status_code != 200)
+    // Parses the body of the expected response while it is being received, other responses are kept as text.
+    // The DOM is allocated from an arena inside the sink that is released as a whole when the next response
+    // begins, so values returned by release() must not be kept past that.
+    class json_sink : public transport::body_sink
     {
-        std::ostringstream os;
-        os << "Login failed, http status: " << resp.status_code << ", msg: " << resp.body;
-        throw std::system_error(ERROR_ACCESS_DENIED, std::system_category(), os.str());
-    }
+    public:
+        explicit json_sink(DWORD expected_status) :
+            expected_status_(expected_status),
+            arena_(buffer_, sizeof(buffer_))
+        {
+        }
 
-    std::wclog << L"Login succeeded." << std::endl;
+        bool begin(const http_client::response& resp) override
+        {
+            if (resp.status_code != expected_status_)
+            {
+                return false;
+            }
 
-    const auto jv = boost::json::parse(resp.body);
-    const auto token_type = boost::json::value_to<std::string>(jv.at("token_type"));
-    const auto token = boost::json::value_to<std::string>(jv.at("access_token"));
+            arena_.release();
+            parser_.reset(boost::json::storage_ptr(&arena_));
+            return true;
+        }
 
-    token_ = encoder::to_wstring(token_type + " " + token);
+        void write(const char* data, std::size_t size) override
+        {
+            parser_.write(data, size);
+        }
 
-    store_token();
+        boost::json::value release()
+        {
+            parser_.finish();
+            return parser_.release();
+        }
+
+    private:
+        const DWORD expected_status_;
+        unsigned char buffer_[json_arena_size];
+        boost::json::monotonic_resource arena_;
+        boost::json::stream_parser parser_;
+    };
 }
 
-void acs::store_token() const
+acs::acs(const std::wstring& authority, const std::wstring& tenant, const std::wstring& client_id, const std::wstring& client_secret) :
+    client_(),
+    tokens_(client_, authority, tenant, client_id, client_secret)
 {
-    boost::lock_guard<boost::interprocess::interprocess_recursive_mutex> grd(*ip_mutex);
-
-    std::wclog << L"Storing token..." << std::endl;
-
-    boost::json::object jo;
-    jo["tenant"] = encoder::to_string(tenant_);
-    jo["id"] = encoder::to_string(client_id_);
-    jo["secret"] = encoder::to_string(client_secret_);
-    jo["token"] = encoder::to_string(token_);
-
-    file::write(token_file_, encoder::encrypt_dpapi(boost::json::serialize(jo)));
-    std::wclog << L"Token stored." << std::endl;
 }
 
-std::wstring acs::load_token() const
+http_client::response acs::send_authorized(const request_fn& request, http_client::header_map headers, DWORD expected_status, unsigned retries, bool& throttled)
 {
-    boost::lock_guard<boost::interprocess::interprocess_recursive_mutex> grd(*ip_mutex);
-
-    std::wclog << L"Loading token..." << std::endl;
+    auto token = tokens_.token();
+    bool reauthenticated = false;
 
-    std::wstring token;
-    if (::GetFileAttributesW(token_file_.c_str()) == INVALID_FILE_ATTRIBUTES)
+    for (unsigned attempt = 0;;)
     {
-        std::wclog << L"Token file doesn't exist, not logged in yet." << std::endl;
-        return token;
-    }
+        headers[L"Authorization"] = token;
 
-    try
-    {
-        const auto jv = boost::json::parse(encoder::decrypt_dpapi(file::read(token_file_)));
-        const auto stored_tenant = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("tenant")));
-        const auto stored_client_id = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("id")));
-        const auto stored_client_secret = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("secret")));
-        if (stored_tenant == tenant_ && stored_client_id == client_id_ && stored_client_secret == client_secret_)
+        auto resp = request(headers);
+        if (resp.status_code == expected_status)
         {
-            std::wclog << L"Found a cached token for current credentials." << std::endl;
-            token = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("token")));
+            return resp;
         }
-        else
+
+        if (resp.status_code == HTTP_STATUS_DENIED && !reauthenticated)
         {
-            std::wclog << L"Found a cached token, but the credentials don't match." << std::endl;
+            token = tokens_.refresh(token);
+            reauthenticated = true;
+            continue;
+        }
+
+        if (resp.status_code == 429)
+        {
+            throttled = true;
+        }
+
+        if (is_transient(resp.status_code) && attempt < retries)
+        {
+            const auto delay = retry_delay(resp, attempt++);
+            LOG_WARNING << L"Got http status code: " << resp.status_code << L", retrying in " << delay << L" ms...";
+            ::Sleep(delay);
+            continue;
         }
-    }
-    catch (const std::exception& exc)
-    {
-        std::wclog << L"Failed to load token file: " << exc << std::endl;
-    }
 
-    return token;
+        std::ostringstream os;
+        os << "Got unexpected http status code: " << resp.status_code << ", msg: " << resp.body;
+        throw std::system_error(HTTP_E_STATUS_UNEXPECTED_SERVER_ERROR, std::system_category(), os.str());
+    }
 }
 
-acs::signing_result acs::sign_digest(unsigned alg_id, const std::string& digest, const std::string& endpoint, const std::string& account, const std::string& profile, const std::string& correlation_id)
+acs::signing_result acs::sign_digest(unsigned alg_id, const std::string& digest, const std::vector<std::string>& endpoints, const std::string& account, const std::string& profile, const std::string& correlation_id)
 {
-    std::wclog << L"Signing digest..." << std::endl;
+    LOG_INFO << L"Signing digest...";
 
     std::string signature_alg;
     switch (alg_id)
@@ -140,49 +148,80 @@ acs::signing_result acs::sign_digest(unsigned alg_id, const std::string& digest,
         throw std::invalid_argument("invalid alg_id");
     }
 
-    if (token_.empty())
+    const auto ranked = endpoint_health::instance().rank(endpoints);
+    for (std::size_t i = 0;; ++i)
     {
-        std::wclog << L"Authentication token is missing, requesting one now..." << std::endl;
-        login();
+        const auto& endpoint = ranked[i];
+        const bool last = i + 1 == ranked.size();
+        bool submitted = false;
+        try
+        {
+            return sign_at(signature_alg, digest, endpoint, account, profile, correlation_id, last, submitted);
+        }
+        catch (const std::exception& exc)
+        {
+            // The operation id is only known to the region it was submitted to.
+            if (submitted || last)
+            {
+                throw;
+            }
+
+            LOG_WARNING << L"Submitting to " << encoder::to_wstring(endpoint) << L" failed, trying the next endpoint: " << exc;
+        }
     }
+}
 
-    boost::json::object jo;
-    jo["signatureAlgorithm"] = signature_alg;
-    jo["digest"] = digest;
-    jo["correlationId"] = correlation_id;
-    const auto body = boost::json::serialize(jo);
+acs::signing_result acs::sign_at(const std::string& signature_alg, const std::string& digest, const std::string& endpoint, const std::string& account, const std::string& profile,
+                                 const std::string& correlation_id, bool last, bool& submitted)
+{
+    const auto& requests = builder(endpoint, account, profile);
+
+    std::string body;
+    body.reserve(64 + digest.size() + correlation_id.size());
+    requests.sign_body(signature_alg, digest, correlation_id, body);
 
-    std::wostringstream wos;
-    wos << encoder::to_wstring(boost::trim_right_copy_if(endpoint, boost::is_any_of(L"/")))
-        << L"/codesigningaccounts/" << encoder::to_wstring(encoder::url_encode(account))
-        << L"/certificateprofiles/" << encoder::to_wstring(encoder::url_encode(profile))
-        << L"/sign"
-        << L"?api-version=" << API_VERSION;
-    const auto uri = wos.str();
+    const auto& uri = requests.sign_uri();
 
     http_client::header_map headers;
     headers[L"Accept"] = L"application/json";
     headers[L"Content-Type"] = L"application/json";
-    headers[L"Authorization"] = token_;
 
-    auto resp = client_.post(uri, body, headers, 2);
-    if (resp.status_code != 202)
+    // Operations of all processes on this machine are admitted per endpoint and account, the service throttles
+    // per account.
+    auto& gate = admission_gate::instance();
+    const auto gate_key = std::hash<std::string>()(endpoint + '\n' + account);
+    bool throttled = false;
+    std::size_t slot = admission_gate::no_slot;
     {
-        std::wclog << L"Got unexpected http status code: " << resp.status_code << L". refreshing token..." << std::endl;
-        login();
-
-        headers[L"Authorization"] = token_;
+        const trace::span span("admission");
+        slot = gate.acquire(gate_key);
+    }
+    const auto slot_grd = scoped_cleanup([&]() { gate.release(gate_key, slot, throttled); });
 
-        resp = client_.post(uri, body, headers, 2);
-        if (resp.status_code != 202)
-        {
-            std::ostringstream os;
-            os << "Got another unexpected http status code: " << resp.status_code << ", msg: " << resp.body;
-            throw std::system_error(HTTP_E_STATUS_UNEXPECTED_SERVER_ERROR, std::system_category(), os.str());
-        }
+    json_sink submit_sink(HTTP_STATUS_ACCEPTED);
+    http_client::response resp;
+    {
+        const trace::span span("submit");
+        resp = send_authorized([&](const http_client::header_map& h)
+            {
+                // Only the submit exchange itself rates the endpoint. Our own queueing, polling and long-running
+                // signatures say nothing about the region, and throttling is per account.
+                const auto started = std::chrono::steady_clock::now();
+                bool failed = true;
+                const auto report_grd = scoped_cleanup([&]()
+                    {
+                        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+                        endpoint_health::instance().report(endpoint, elapsed, failed);
+                    });
+
+                // With another region to go to, a failed submit moves on right away instead of backing off here.
+                auto r = client_.post(uri, body, h, last ? 2 : 0, &submit_sink);
+                failed = r.status_code >= 500;
+                return r;
+            }, headers, HTTP_STATUS_ACCEPTED, last ? transient_retries : 0, throttled);
     }
 
-    auto respjson = boost::json::parse(resp.body);
+    const auto respjson = submit_sink.release();
     const auto status = boost::json::value_to<std::string>(respjson.at("status"));
     if (status != "InProgress")
     {
@@ -192,60 +231,75 @@ acs::signing_result acs::sign_digest(unsigned alg_id, const std::string& digest,
     }
 
     const auto opid = boost::json::value_to<std::string>(respjson.at("operationId"));
-    std::wclog << L"Signing request submitted. Operation id: " << encoder::to_wstring(opid) << std::endl;
-    return wait_for_signing_completion(endpoint, account, profile, opid);
+    submitted = true;
+    LOG_INFO << L"Signing request submitted." << logging::field(L"operation_id", opid);
+
+    // Started only now, time spent waiting for admission or submitting doesn't count against the poll deadline.
+    poll_scheduler scheduler(endpoint + "/" + account + "/" + profile);
+
+    const auto operation_location = resp.headers.find(L"Operation-Location");
+    if (operation_location != resp.headers.end())
+    {
+        return wait_for_signing_completion(operation_location->second, resp, scheduler, throttled);
+    }
+
+    std::wstring status_uri;
+    requests.status_uri(opid, status_uri);
+
+    return wait_for_signing_completion(status_uri, resp, scheduler, throttled);
 }
 
-acs::signing_result acs::wait_for_signing_completion(const std::string& endpoint, const std::string& account, const std::string& profile, const std::string& opid)
+const request_builder& acs::builder(const std::string& endpoint, const std::string& account, const std::string& profile)
 {
-    std::wclog << L"Waiting for signing to complete..." << std::endl;
+    const auto key = endpoint + '\n' + account + '\n' + profile;
 
-    std::wostringstream wos;
-    wos << encoder::to_wstring(boost::trim_right_copy_if(endpoint, boost::is_any_of(L"/")))
-       << L"/codesigningaccounts/" << encoder::to_wstring(encoder::url_encode(account))
-       << L"/certificateprofiles/" << encoder::to_wstring(encoder::url_encode(profile))
-       << L"/sign/" << encoder::to_wstring(opid)
-       << L"?api-version=" << API_VERSION;
-
-    const auto uri = wos.str();
+    boost::lock_guard<boost::mutex> lock(builders_mutex_);
+    auto& entry = builders_[key];
+    if (!entry)
+    {
+        entry.reset(new request_builder(endpoint, account, profile));
+    }
+    return *entry;
+}
 
-    http_client::header_map headers;
-    headers[L"Authorization"] = token_;
+acs::signing_result acs::wait_for_signing_completion(const std::wstring& uri, const http_client::response& submitted, poll_scheduler& scheduler, bool& throttled)
+{
+    LOG_INFO << L"Waiting for signing to complete...";
 
-    for (int retry = 0; retry < 100; ++retry)
+    json_sink polled(HTTP_STATUS_OK);
+    auto delay = scheduler.next_delay(submitted);
+    while (!scheduler.expired())
     {
-        ::Sleep(1000);
+        ::Sleep(static_cast<DWORD>(delay.count()));
 
-        auto resp = client_.get(uri, headers, 2);
-        if (resp.status_code == 200)
-        {
-            auto respjson = boost::json::parse(resp.body);
-            const auto status = boost::json::value_to<std::string>(respjson.at("status"));
-            if (status == "InProgress")
-            {
-                std::wclog << L"Signing in progress, waiting..." << std::endl;
-                continue;
-            }
-            
-            if (status == "Succeeded")
-            {
-                std::wclog << L"Signing succeded." << std::endl;
+        const trace::span span("poll");
 
-                signing_result result;
-                result.signature = encoder::base64_decode(boost::json::value_to<std::string>(respjson.at("signature")));
-                result.certificate = encoder::base64_decode(boost::json::value_to<std::string>(respjson.at("signingCertificate")));
-                return result;
-            }
+        const auto resp = send_authorized([&](const http_client::header_map& h) { return client_.get_hedged(uri, h, 2, &polled); }, http_client::header_map(), HTTP_STATUS_OK, transient_retries, throttled);
 
-            throw std::system_error(ERROR_INVALID_STATE, std::system_category(), "Unexpected signing status: " + status);
+        const auto respjson = polled.release();
+        const auto status = boost::json::value_to<std::string>(respjson.at("status"));
+        if (status == "InProgress")
+        {
+            delay = scheduler.next_delay(resp);
+            LOG_DEBUG << L"Signing in progress, waiting " << delay.count() << L" ms...";
+            continue;
         }
-        else
+        
+        if (status == "Succeeded")
         {
-            std::ostringstream os;
-            os << "Got another unexpected http status code: " << resp.status_code << ", msg: " << resp.body;
-            throw std::system_error(HTTP_E_STATUS_UNEXPECTED_SERVER_ERROR, std::system_category(), os.str());
+            LOG_INFO << L"Signing succeded.";
+            scheduler.completed();
+
+            const trace::span decode_span("base64 decode");
+
+            signing_result result;
+            result.signature = encoder::base64_decode(boost::json::value_to<std::string>(respjson.at("signature")));
+            result.certificate = boost::json::value_to<std::string>(respjson.at("signingCertificate"));
+            return result;
         }
+
+        throw std::system_error(ERROR_INVALID_STATE, std::system_category(), "Unexpected signing status: " + status);
     }
 
-    throw std::system_error(ERROR_TIMEOUT, std::system_category(), "Retry counter exhausted, giving up.");
+    throw std::system_error(ERROR_TIMEOUT, std::system_category(), "Signing did not complete in time, giving up.");
 }
@@ -1,33 +1,47 @@
 #pragma once
 
 #include "http_client.h"
+#include "poll_scheduler.h"
+#include "request_builder.h"
+#include "token_manager.h"
 
 class acs : boost::noncopyable
 {
 public:
-    acs(const std::wstring& tenant, const std::wstring& client_id, const std::wstring& client_secret);
-
-    void login();
+    acs(const std::wstring& authority, const std::wstring& tenant, const std::wstring& client_id, const std::wstring& client_secret);
 
     struct signing_result
     {
         std::string signature;
+
+        // Base64 PKCS#7 chain as sent by the service, see cert_cache.
         std::string certificate;
     };
 
-    signing_result sign_digest(unsigned alg_id, const std::string& digest, const std::string& endpoint, const std::string& account, const std::string& profile, const std::string& correlation_id);
+    // `endpoints` are equivalent regions, the operation goes to the healthiest one and moves on to the next if
+    // it can't be submitted there. Once submitted, it is bound to its region.
+    signing_result sign_digest(unsigned alg_id, const std::string& digest, const std::vector<std::string>& endpoints, const std::string& account, const std::string& profile, const std::string& correlation_id);
 
 private:
-    void store_token() const;
+    typedef std::function<http_client::response(const http_client::header_map&)> request_fn;
+
+    // Sends the request with the current token, re-authenticating once on 401 and retrying throttled or failed requests
+    // up to `retries` times. Sets `throttled` when the service answered 429 on the way.
+    http_client::response send_authorized(const request_fn& request, http_client::header_map headers, DWORD expected_status, unsigned retries, bool& throttled);
 
-    std::wstring load_token() const;
+    // Request builders are cached per endpoint/account/profile, so the URIs are encoded only once per process.
+    const request_builder& builder(const std::string& endpoint, const std::string& account, const std::string& profile);
 
-    signing_result wait_for_signing_completion(const std::string& endpoint, const std::string& account, const std::string& profile, const std::string& opid);
+    // Sets `submitted` once the operation exists at `endpoint`, after which it can't be moved elsewhere. Unless `last`,
+    // the submit is not retried, another endpoint is tried instead.
+    signing_result sign_at(const std::string& signature_alg, const std::string& digest, const std::string& endpoint, const std::string& account, const std::string& profile,
+                           const std::string& correlation_id, bool last, bool& submitted);
+
+    signing_result wait_for_signing_completion(const std::wstring& uri, const http_client::response& submitted, poll_scheduler& scheduler, bool& throttled);
 
     http_client client_;
-    std::wstring tenant_;
-    std::wstring client_id_;
-    std::wstring client_secret_;
-    std::wstring token_;
-    std::wstring token_file_;
-};
\ No newline at end of file
+    token_manager tokens_;
+
+    boost::mutex builders_mutex_;
+    std::map<std::string, std::unique_ptr<request_builder>> builders_;
+};
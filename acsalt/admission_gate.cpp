@@ -0,0 +1,196 @@
+#include "pch.h"
+#include "admission_gate.h"
+#include "ipc_security.h"
+#include "logging.h"
+
+namespace
+{
+    const std::size_t max_lanes = 16;
+    const std::size_t max_limit = 64;
+    const std::size_t max_waiters = 1024;
+
+    const double initial_limit = 16;
+    const double min_limit = 1;
+
+    // One decrease per throttling episode, not one per throttled operation that was already in flight.
+    const ULONGLONG decrease_interval_ms = 1000;
+
+    // Waiters wake up this often to skip over processes that died in the queue or holding a slot.
+    const boost::posix_time::seconds owner_check_interval(1);
+
+    bool process_alive(DWORD pid)
+    {
+        HANDLE process = ::OpenProcess(SYNCHRONIZE, FALSE, pid);
+        if (!process)
+        {
+            return ::GetLastError() == ERROR_ACCESS_DENIED;
+        }
+
+        const bool alive = ::WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+        ::CloseHandle(process);
+        return alive;
+    }
+}
+
+struct admission_gate::state
+{
+    // Tickets are handed out in order, the one at `head` is next once a slot is free.
+    struct lane
+    {
+        std::uint64_t key;
+        double limit;
+        ULONGLONG last_decrease;
+        std::uint32_t in_flight;
+        DWORD holders[max_limit];
+        std::uint64_t head;
+        std::uint64_t tail;
+        DWORD waiters[max_waiters];
+
+        void skip_dead_waiters()
+        {
+            while (head != tail && !process_alive(waiters[head % max_waiters]))
+            {
+                ++head;
+            }
+        }
+
+        void reclaim_slots()
+        {
+            for (auto& pid : holders)
+            {
+                if (pid && !process_alive(pid))
+                {
+                    pid = 0;
+                    --in_flight;
+                }
+            }
+        }
+    };
+
+    state()
+    {
+        std::memset(lanes, 0, sizeof(lanes));
+    }
+
+    lane* find(std::uint64_t key)
+    {
+        lane* free = nullptr;
+        for (auto& l : lanes)
+        {
+            if (l.key == key)
+            {
+                return &l;
+            }
+
+            if (!free && !l.key)
+            {
+                free = &l;
+            }
+        }
+
+        if (free)
+        {
+            free->key = key;
+            free->limit = initial_limit;
+        }
+        return free;
+    }
+
+    boost::interprocess::interprocess_mutex mutex;
+    boost::interprocess::interprocess_condition changed;
+    lane lanes[max_lanes];
+};
+
+admission_gate& admission_gate::instance()
+{
+    static admission_gate gate;
+    return gate;
+}
+
+admission_gate::admission_gate() :
+    shm_(boost::interprocess::open_or_create, ipc_security::object_name("acsalt-admission").c_str(), 256 * 1024, nullptr, ipc_security::owner_only()),
+    state_(shm_.find_or_construct<state>("state")())
+{
+}
+
+std::size_t admission_gate::acquire(std::uint64_t key)
+{
+    boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+
+    auto lane = state_->find(key);
+    if (!lane || lane->tail - lane->head == max_waiters)
+    {
+        return no_slot;
+    }
+
+    const auto ticket = lane->tail++;
+    lane->waiters[ticket % max_waiters] = ::GetCurrentProcessId();
+
+    bool logged = false;
+    for (;;)
+    {
+        lane->skip_dead_waiters();
+
+        if (lane->head == ticket && lane->in_flight >= static_cast<std::uint32_t>(lane->limit))
+        {
+            lane->reclaim_slots();
+        }
+
+        if (lane->head == ticket && lane->in_flight < static_cast<std::uint32_t>(lane->limit))
+        {
+            for (std::size_t slot = 0; slot < max_limit; ++slot)
+            {
+                if (!lane->holders[slot])
+                {
+                    lane->holders[slot] = ::GetCurrentProcessId();
+                    ++lane->in_flight;
+                    ++lane->head;
+
+                    // The next in line may fit as well.
+                    state_->changed.notify_all();
+                    return slot;
+                }
+            }
+        }
+
+        if (!logged)
+        {
+            LOG_DEBUG << L"Waiting for a signing slot, " << lane->in_flight << L" in flight, limit " << static_cast<unsigned>(lane->limit) << L".";
+            logged = true;
+        }
+        state_->changed.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + owner_check_interval);
+    }
+}
+
+void admission_gate::release(std::uint64_t key, std::size_t slot, bool throttled)
+{
+    if (slot == no_slot)
+    {
+        return;
+    }
+
+    {
+        boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+
+        auto lane = state_->find(key);
+        if (lane && lane->holders[slot] == ::GetCurrentProcessId())
+        {
+            lane->holders[slot] = 0;
+            --lane->in_flight;
+
+            const auto now = ::GetTickCount64();
+            if (throttled && now - lane->last_decrease >= decrease_interval_ms)
+            {
+                lane->limit = std::max(lane->limit / 2, min_limit);
+                lane->last_decrease = now;
+                LOG_INFO << L"Service is throttling, signing concurrency lowered to " << static_cast<unsigned>(lane->limit) << L".";
+            }
+            else if (!throttled)
+            {
+                lane->limit = std::min(lane->limit + 1 / lane->limit, static_cast<double>(max_limit));
+            }
+        }
+    }
+
+    state_->changed.notify_all();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Machine-wide cap on signing operations in flight per endpoint and account, shared by all processes through
+// a named segment. The cap adapts AIMD style: it grows by about one per round of completed operations and is
+// halved when the service throttles. Callers over the cap wait in arrival order.
+class admission_gate : boost::noncopyable
+{
+public:
+    static const std::size_t no_slot = static_cast<std::size_t>(-1);
+
+    // Opens or creates the shared segment on first use.
+    static admission_gate& instance();
+
+    // Blocks until `key` has room for one more operation. Returns the slot to release, or no_slot when the gate
+    // is full of other keys or waiters and the caller goes ahead uncoordinated.
+    std::size_t acquire(std::uint64_t key);
+
+    // `throttled` tells whether the service answered 429 during the operation.
+    void release(std::uint64_t key, std::size_t slot, bool throttled);
+
+private:
+    admission_gate();
+
+    struct state;
+
+    boost::interprocess::managed_windows_shared_memory shm_;
+    state* state_;
+};
@@ -0,0 +1,395 @@
+#include "pch.h"
+#include "encoder.h"
+
+#include <intrin.h>
+#include <immintrin.h>
+
+// Table-driven base64 codec with SSSE3 and AVX2 fast paths, selected at runtime. The vector kernels follow
+// Wojciech Mula's and Daniel Lemire's base64 algorithms, the scalar code handles the tails, padding and whitespace.
+namespace
+{
+    const char encode_table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    const std::uint8_t invalid = 0xff;
+    const std::uint8_t whitespace = 0xfe;
+
+    struct decode_table_t
+    {
+        decode_table_t()
+        {
+            std::fill(std::begin(values), std::end(values), invalid);
+            for (std::uint8_t i = 0; i < 64; ++i)
+            {
+                values[static_cast<std::uint8_t>(encode_table[i])] = i;
+            }
+            values[' '] = values['\t'] = values['\r'] = values['\n'] = whitespace;
+        }
+
+        std::uint8_t values[256];
+    };
+
+    const decode_table_t decode_table;
+
+    enum class isa
+    {
+        scalar,
+        ssse3,
+        avx2
+    };
+
+    isa detect_isa()
+    {
+        int info[4] = { 0 };
+        ::__cpuid(info, 0);
+        const int max_leaf = info[0];
+
+        ::__cpuid(info, 1);
+        const bool ssse3 = (info[2] & (1 << 9)) != 0;
+        const bool osxsave = (info[2] & (1 << 27)) != 0;
+        const bool avx = (info[2] & (1 << 28)) != 0;
+
+        bool avx2 = false;
+        if (max_leaf >= 7 && osxsave && avx && (::_xgetbv(0) & 6) == 6)
+        {
+            ::__cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+        }
+
+        return avx2 ? isa::avx2 : (ssse3 ? isa::ssse3 : isa::scalar);
+    }
+
+    const isa cpu_isa = detect_isa();
+
+    // 12 input bytes in the low 12 bytes of each 128-bit lane -> 16 base64 characters.
+    __m128i encode_block_ssse3(__m128i in)
+    {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+        const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        const __m128i indices = _mm_or_si128(t1, t3);
+
+        // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12; then add the offset of that range.
+        __m128i reduced = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        const __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        reduced = _mm_or_si128(reduced, _mm_and_si128(less, _mm_set1_epi8(13)));
+
+        const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                              '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        return _mm_add_epi8(_mm_shuffle_epi8(offsets, reduced), indices);
+    }
+
+    __m256i encode_block_avx2(__m256i in)
+    {
+        in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                                                     10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+
+        const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        const __m256i indices = _mm256_or_si256(t1, t3);
+
+        __m256i reduced = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        reduced = _mm256_or_si256(reduced, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+
+        const __m256i offsets = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                 '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                                                 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                                 '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+        return _mm256_add_epi8(_mm256_shuffle_epi8(offsets, reduced), indices);
+    }
+
+    // Encodes whole 12/24 byte blocks while the loads stay inside the input. Returns the number of bytes consumed.
+    std::size_t encode_ssse3(const std::uint8_t* in, std::size_t size, char* out)
+    {
+        std::size_t i = 0;
+        for (; size - i >= 16; i += 12, out += 16)
+        {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), encode_block_ssse3(v));
+        }
+        return i;
+    }
+
+    std::size_t encode_avx2(const std::uint8_t* in, std::size_t size, char* out)
+    {
+        std::size_t i = 0;
+        for (; size - i >= 28; i += 24, out += 32)
+        {
+            const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12));
+            const __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), encode_block_avx2(v));
+        }
+        return i;
+    }
+
+    // Validates and translates 16/32 characters, returns false if any of them is not in the base64 alphabet.
+    bool decode_block_ssse3(const char* in, std::uint8_t* out)
+    {
+        const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0)
+        {
+            return false;
+        }
+
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+
+        // Merge the 6-bit values into 24-bit groups and pack them together.
+        const __m128i merged = _mm_madd_epi16(_mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140)), _mm_set1_epi32(0x00011000));
+        const __m128i packed = _mm_shuffle_epi8(merged, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), packed);
+        return true;
+    }
+
+    bool decode_block_avx2(const char* in, std::uint8_t* out)
+    {
+        const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+        {
+            return false;
+        }
+
+        const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        str = _mm256_add_epi8(str, roll);
+
+        const __m256i merged = _mm256_madd_epi16(_mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140)), _mm256_set1_epi32(0x00011000));
+        __m256i packed = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                                      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), packed);
+        return true;
+    }
+
+    // Decodes whole blocks until one of them needs the scalar path (whitespace, padding, garbage) or the input or
+    // output runs out. The vector stores write a few bytes past the decoded data, hence the extra room required.
+    void decode_blocks(const char* in, std::size_t size, std::uint8_t* out, std::size_t capacity, std::size_t& consumed, std::size_t& produced)
+    {
+        consumed = produced = 0;
+
+        if (cpu_isa == isa::avx2)
+        {
+            while (size - consumed >= 32 && capacity - produced >= 32 && decode_block_avx2(in + consumed, out + produced))
+            {
+                consumed += 32;
+                produced += 24;
+            }
+        }
+
+        if (cpu_isa != isa::scalar)
+        {
+            while (size - consumed >= 16 && capacity - produced >= 16 && decode_block_ssse3(in + consumed, out + produced))
+            {
+                consumed += 16;
+                produced += 12;
+            }
+        }
+    }
+
+    [[noreturn]] void throw_invalid_input()
+    {
+        throw std::system_error(ERROR_INVALID_DATA, std::system_category(), "Invalid base64 input.");
+    }
+
+    [[noreturn]] void throw_insufficient_buffer()
+    {
+        throw std::system_error(ERROR_INSUFFICIENT_BUFFER, std::system_category(), "Base64 output buffer is too small.");
+    }
+}
+
+namespace encoder {
+
+std::size_t base64_encoded_size(std::size_t size)
+{
+    return (size + 2) / 3 * 4;
+}
+
+std::size_t base64_decoded_size(std::size_t size)
+{
+    return (size + 3) / 4 * 3;
+}
+
+std::size_t base64_encode(const BYTE* input, std::size_t size, char* output)
+{
+    std::size_t i = 0;
+    char* out = output;
+
+    if (cpu_isa == isa::avx2)
+    {
+        const auto consumed = encode_avx2(input, size, out);
+        i += consumed;
+        out += consumed / 3 * 4;
+    }
+
+    if (cpu_isa != isa::scalar)
+    {
+        const auto consumed = encode_ssse3(input + i, size - i, out);
+        i += consumed;
+        out += consumed / 3 * 4;
+    }
+
+    for (; size - i >= 3; i += 3)
+    {
+        const std::uint32_t group = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        *out++ = encode_table[(group >> 18) & 0x3f];
+        *out++ = encode_table[(group >> 12) & 0x3f];
+        *out++ = encode_table[(group >> 6) & 0x3f];
+        *out++ = encode_table[group & 0x3f];
+    }
+
+    if (size - i == 1)
+    {
+        const std::uint32_t group = input[i] << 16;
+        *out++ = encode_table[(group >> 18) & 0x3f];
+        *out++ = encode_table[(group >> 12) & 0x3f];
+        *out++ = '=';
+        *out++ = '=';
+    }
+    else if (size - i == 2)
+    {
+        const std::uint32_t group = (input[i] << 16) | (input[i + 1] << 8);
+        *out++ = encode_table[(group >> 18) & 0x3f];
+        *out++ = encode_table[(group >> 12) & 0x3f];
+        *out++ = encode_table[(group >> 6) & 0x3f];
+        *out++ = '=';
+    }
+
+    return static_cast<std::size_t>(out - output);
+}
+
+std::size_t base64_decode(const char* input, std::size_t size, BYTE* output, std::size_t capacity)
+{
+    std::size_t i = 0;
+    std::size_t o = 0;
+    std::uint8_t quad[4] = { 0 };
+    unsigned q = 0;
+    unsigned padding = 0;
+
+    while (i < size)
+    {
+        if (q == 0 && padding == 0)
+        {
+            std::size_t consumed = 0;
+            std::size_t produced = 0;
+            decode_blocks(input + i, size - i, output + o, capacity - o, consumed, produced);
+            i += consumed;
+            o += produced;
+            if (i == size)
+            {
+                break;
+            }
+        }
+
+        const auto c = static_cast<std::uint8_t>(input[i++]);
+        const auto value = decode_table.values[c];
+        if (value == whitespace)
+        {
+            continue;
+        }
+
+        if (c == '=')
+        {
+            // Padding may only complete a quantum of two or three characters.
+            if (q < 2 || q + padding >= 4)
+            {
+                throw_invalid_input();
+            }
+            ++padding;
+            continue;
+        }
+
+        if (value == invalid || padding != 0)
+        {
+            throw_invalid_input();
+        }
+
+        quad[q++] = value;
+        if (q == 4)
+        {
+            if (capacity - o < 3)
+            {
+                throw_insufficient_buffer();
+            }
+
+            output[o++] = static_cast<BYTE>((quad[0] << 2) | (quad[1] >> 4));
+            output[o++] = static_cast<BYTE>((quad[1] << 4) | (quad[2] >> 2));
+            output[o++] = static_cast<BYTE>((quad[2] << 6) | quad[3]);
+            q = 0;
+        }
+    }
+
+    // Trailing partial quantum, with or without its padding.
+    if (q == 1)
+    {
+        throw_invalid_input();
+    }
+
+    if (capacity - o < (q == 0 ? 0u : q - 1))
+    {
+        throw_insufficient_buffer();
+    }
+
+    if (q >= 2)
+    {
+        output[o++] = static_cast<BYTE>((quad[0] << 2) | (quad[1] >> 4));
+    }
+
+    if (q == 3)
+    {
+        output[o++] = static_cast<BYTE>((quad[1] << 4) | (quad[2] >> 2));
+    }
+
+    return o;
+}
+
+std::string base64_encode(LPCBYTE buffer, DWORD size)
+{
+    std::string out(base64_encoded_size(size), 0);
+    out.resize(base64_encode(buffer, size, &out[0]));
+    return out;
+}
+
+std::string base64_encode(const std::string& input)
+{
+    return base64_encode(reinterpret_cast<LPCBYTE>(input.data()), static_cast<DWORD>(input.size()));
+}
+
+std::string base64_decode(const std::string& input)
+{
+    // The vector kernels store whole registers, leave them room past the decoded data.
+    std::string out(base64_decoded_size(input.size()) + 32, 0);
+    out.resize(base64_decode(input.data(), input.size(), reinterpret_cast<BYTE*>(&out[0]), out.size()));
+    return out;
+}
+
+}
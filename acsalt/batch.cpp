@@ -0,0 +1,434 @@
+#include "pch.h"
+#include "batch.h"
+
+#include "encoder.h"
+#include "exception_strm.h"
+#include "file.h"
+#include "logging.h"
+#include "pe_digest.h"
+#include "scoped_cleanup.h"
+#include "timestamp_client.h"
+#include "win32_error.h"
+
+#include <shellapi.h>
+
+#include <iomanip>
+#include <sstream>
+
+// Exported digest callback, see AuthenticodeDigestSign.cpp.
+HRESULT WINAPI AuthenticodeDigestSignEx(PDATA_BLOB pMetadataBlob, ALG_ID digestAlgId, BYTE* pbToBeSignedDigest, DWORD cbToBeSignedDigest, PCRYPT_DIGEST_BLOB pSignedDigest, PCCERT_CONTEXT* ppSignerCert, void* hCertChainStore);
+
+namespace
+{
+    // mssign32 structures, documented on MSDN but not shipped in the SDK headers.
+    struct signer_file_info
+    {
+        DWORD cbSize;
+        LPCWSTR pwszFileName;
+        HANDLE hFile;
+    };
+
+    struct signer_subject_info
+    {
+        DWORD cbSize;
+        DWORD* pdwIndex;
+        DWORD dwSubjectChoice;
+        signer_file_info* pSignerFileInfo;
+    };
+
+    struct signer_cert_store_info
+    {
+        DWORD cbSize;
+        PCCERT_CONTEXT pSigningCert;
+        DWORD dwCertPolicy;
+        HCERTSTORE hCertStore;
+    };
+
+    struct signer_cert
+    {
+        DWORD cbSize;
+        DWORD dwCertChoice;
+        signer_cert_store_info* pCertStoreInfo;
+        HWND hwnd;
+    };
+
+    struct signer_attr_authcode
+    {
+        DWORD cbSize;
+        BOOL fCommercial;
+        BOOL fIndividual;
+        LPCWSTR pwszName;
+        LPCWSTR pwszInfo;
+    };
+
+    struct signer_signature_info
+    {
+        DWORD cbSize;
+        ALG_ID algidHash;
+        DWORD dwAttrChoice;
+        signer_attr_authcode* pAttrAuthcode;
+        PCRYPT_ATTRIBUTES psAuthenticated;
+        PCRYPT_ATTRIBUTES psUnauthenticated;
+    };
+
+    struct signer_context
+    {
+        DWORD cbSize;
+        DWORD cbBlob;
+        BYTE* pbBlob;
+    };
+
+    // Declared like the export, which signtool also calls through this pointer.
+    typedef HRESULT(WINAPI* digest_sign_ex_fn)(PDATA_BLOB, ALG_ID, BYTE*, DWORD, PCRYPT_DIGEST_BLOB, PCCERT_CONTEXT*, void*);
+
+    struct signer_digest_sign_info
+    {
+        DWORD cbSize;
+        DWORD dwDigestSignChoice;
+        digest_sign_ex_fn pfnAuthenticodeDigestSignEx;
+        PDATA_BLOB pMetadataBlob;
+        DWORD dwReserved;
+        DWORD dwReserved2;
+        DWORD dwReserved3;
+    };
+
+    typedef HRESULT(WINAPI* signer_sign_ex3_fn)(DWORD, signer_subject_info*, signer_cert*, signer_signature_info*, void*, DWORD, LPCSTR, LPCWSTR,
+                                                PCRYPT_ATTRIBUTES, void*, signer_context**, void*, signer_digest_sign_info*, void*);
+    typedef HRESULT(WINAPI* signer_free_signer_context_fn)(signer_context*);
+
+    const DWORD SIGNER_SUBJECT_FILE = 1;
+    const DWORD SIGNER_CERT_STORE = 2;
+    const DWORD SIGNER_CERT_POLICY_CHAIN = 2;
+    const DWORD SIGNER_AUTHCODE_ATTR = 1;
+    const DWORD SPC_DIGEST_SIGN_EX_FLAG = 0x4000;
+    const DWORD DIGEST_SIGN_EX = 3;
+
+    class mssign : boost::noncopyable
+    {
+    public:
+        mssign() :
+            module_(::LoadLibraryW(L"mssign32.dll"))
+        {
+            if (!module_)
+            {
+                throw win32_error("LoadLibraryW");
+            }
+
+            sign_ = reinterpret_cast<signer_sign_ex3_fn>(::GetProcAddress(module_, "SignerSignEx3"));
+            free_context_ = reinterpret_cast<signer_free_signer_context_fn>(::GetProcAddress(module_, "SignerFreeSignerContext"));
+            if (!sign_ || !free_context_)
+            {
+                const auto error = win32_error("GetProcAddress");
+                ::FreeLibrary(module_);
+                throw error;
+            }
+        }
+
+        ~mssign()
+        {
+            ::FreeLibrary(module_);
+        }
+
+        // Same call signtool makes for /dlib, with this DLL's callback instead of a loaded one.
+        void sign(const std::wstring& path, const batch::options& opts, std::string& metadata) const
+        {
+            signer_file_info file_info = { sizeof(file_info), path.c_str(), nullptr };
+            DWORD index = 0;
+            signer_subject_info subject_info = { sizeof(subject_info), &index, SIGNER_SUBJECT_FILE, &file_info };
+
+            HCERTSTORE store = ::CertOpenStore(CERT_STORE_PROV_MEMORY, 0, 0, 0, nullptr);
+            if (!store)
+            {
+                throw win32_error("CertOpenStore");
+            }
+
+            const auto store_grd = scoped_cleanup([store]() { ::CertCloseStore(store, 0); });
+
+            signer_cert_store_info store_info = { sizeof(store_info), nullptr, SIGNER_CERT_POLICY_CHAIN, store };
+            signer_cert cert = { sizeof(cert), SIGNER_CERT_STORE, &store_info, nullptr };
+
+            signer_attr_authcode authcode = { sizeof(authcode), FALSE, TRUE, nullptr, nullptr };
+            signer_signature_info signature_info = { sizeof(signature_info), opts.digest_alg, SIGNER_AUTHCODE_ATTR, &authcode, nullptr, nullptr };
+
+            DATA_BLOB metadata_blob = { static_cast<DWORD>(metadata.size()), reinterpret_cast<BYTE*>(&metadata[0]) };
+            signer_digest_sign_info digest_sign_info = { sizeof(digest_sign_info), DIGEST_SIGN_EX, &AuthenticodeDigestSignEx, &metadata_blob, 0, 0, 0 };
+
+            signer_context* context = nullptr;
+            const auto context_grd = scoped_cleanup([this, &context]()
+                {
+                    if (context)
+                    {
+                        free_context_(context);
+                    }
+                });
+
+            // Timestamps are added afterwards by timestamp_client, see run().
+            const auto hr = sign_(SPC_DIGEST_SIGN_EX_FLAG, &subject_info, &cert, &signature_info, nullptr, 0, nullptr, nullptr,
+                                  nullptr, nullptr, &context, nullptr, &digest_sign_info, nullptr);
+
+            if (FAILED(hr))
+            {
+                throw std::system_error(hr, std::system_category(), "SignerSignEx3");
+            }
+        }
+
+    private:
+        HMODULE module_;
+        signer_sign_ex3_fn sign_;
+        signer_free_signer_context_fn free_context_;
+    };
+
+    void expand(const std::wstring& input, std::vector<std::wstring>& files)
+    {
+        if (!input.empty() && input[0] == L'@')
+        {
+            std::vector<std::string> lines;
+            const auto list = file::read(input.substr(1));
+            boost::split(lines, list, boost::is_any_of("\r\n"), boost::token_compress_on);
+            for (const auto& line : lines)
+            {
+                const auto path = boost::trim_copy(line);
+                if (!path.empty())
+                {
+                    files.push_back(encoder::to_wstring(path));
+                }
+            }
+            return;
+        }
+
+        if (input.find_first_of(L"*?") == input.npos)
+        {
+            files.push_back(input);
+            return;
+        }
+
+        WIN32_FIND_DATAW data;
+        HANDLE find = ::FindFirstFileW(input.c_str(), &data);
+        if (find == INVALID_HANDLE_VALUE)
+        {
+            LOG_WARNING << L"No files match " << input;
+            return;
+        }
+
+        const auto separator = input.find_last_of(L"\\/");
+        const auto directory = separator == input.npos ? std::wstring() : input.substr(0, separator + 1);
+        do
+        {
+            if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                files.push_back(directory + data.cFileName);
+            }
+        } while (::FindNextFileW(find, &data));
+
+        ::FindClose(find);
+    }
+}
+
+namespace batch
+{
+
+options parse_command_line(const std::wstring& command_line)
+{
+    int argc = 0;
+    LPWSTR* argv = ::CommandLineToArgvW(command_line.c_str(), &argc);
+    if (!argv)
+    {
+        throw win32_error("CommandLineToArgvW");
+    }
+
+    std::vector<std::wstring> args(argv, argv + argc);
+    ::LocalFree(argv);
+
+    options opts;
+    for (std::size_t i = 0; i < args.size(); ++i)
+    {
+        const auto& arg = args[i];
+        const bool has_value = i + 1 < args.size();
+        if (boost::iequals(arg, L"/j") && has_value)
+        {
+            opts.threads = std::max(1, std::stoi(args[++i]));
+        }
+        else if (boost::iequals(arg, L"/fd") && has_value)
+        {
+            const auto& alg = args[++i];
+            if (boost::iequals(alg, L"sha256"))
+            {
+                opts.digest_alg = CALG_SHA_256;
+            }
+            else if (boost::iequals(alg, L"sha384"))
+            {
+                opts.digest_alg = CALG_SHA_384;
+            }
+            else if (boost::iequals(alg, L"sha512"))
+            {
+                opts.digest_alg = CALG_SHA_512;
+            }
+            else
+            {
+                throw std::invalid_argument("unsupported digest algorithm");
+            }
+        }
+        else if (boost::iequals(arg, L"/tr") && has_value)
+        {
+            opts.timestamp_urls.push_back(args[++i]);
+        }
+        else if (boost::iequals(arg, L"/dmdf") && has_value)
+        {
+            opts.metadata_file = args[++i];
+        }
+        else
+        {
+            opts.inputs.push_back(arg);
+        }
+    }
+
+    if (opts.inputs.empty())
+    {
+        throw std::invalid_argument("usage: RunSign [/j threads] [/fd sha256|sha384|sha512] [/tr url]... /dmdf metadata.json files...");
+    }
+
+    return opts;
+}
+
+std::size_t run(const options& opts)
+{
+    if (opts.metadata_file.empty())
+    {
+        throw std::invalid_argument("missing /dmdf metadata file");
+    }
+
+    std::vector<std::wstring> files;
+    for (const auto& input : opts.inputs)
+    {
+        expand(input, files);
+    }
+
+    const auto metadata = file::read(opts.metadata_file);
+    const mssign signer;
+
+    std::unique_ptr<timestamp_client> stamper;
+    if (!opts.timestamp_urls.empty())
+    {
+        stamper.reset(new timestamp_client(opts.timestamp_urls));
+    }
+
+    LOG_INFO << L"Signing " << files.size() << L" files on " << opts.threads << L" threads...";
+
+    // Workers take the next file as soon as they are done, so slow files don't hold up a fixed share of the list.
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::size_t> failed(0);
+    const auto started = std::chrono::steady_clock::now();
+
+    auto worker = [&]()
+        {
+            auto blob = metadata;
+            for (auto i = next++; i < files.size(); i = next++)
+            {
+                const auto begin = std::chrono::steady_clock::now();
+                try
+                {
+                    signer.sign(files[i], opts, blob);
+                    const auto signed_at = std::chrono::steady_clock::now();
+
+                    // The timestamp request of one file overlaps with the signing requests of the others.
+                    if (stamper)
+                    {
+                        stamper->stamp_file(files[i], opts.digest_alg);
+                    }
+
+                    const auto now = std::chrono::steady_clock::now();
+                    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - begin);
+                    const auto stamping = std::chrono::duration_cast<std::chrono::milliseconds>(now - signed_at);
+                    LOG_INFO << L"Signed " << files[i] << L" in " << elapsed.count() << L" ms, " << stamping.count() << L" ms of that timestamping";
+                }
+                catch (const std::exception& exc)
+                {
+                    ++failed;
+                    LOG_ERROR << L"Failed to sign " << files[i] << L": " << exc;
+                }
+            }
+        };
+
+    boost::thread_group workers;
+    const auto count = std::min<std::size_t>(opts.threads, files.size());
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        workers.create_thread(worker);
+    }
+    workers.join_all();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    const auto rate = elapsed.count() ? files.size() * 1000.0 / elapsed.count() : 0.0;
+    LOG_INFO << L"Signed " << files.size() - failed << L" of " << files.size() << L" files in " << elapsed.count() << L" ms (" << rate << L" files/s)";
+
+    return failed;
+}
+
+std::size_t digest(const options& opts)
+{
+    std::vector<std::wstring> files;
+    for (const auto& input : opts.inputs)
+    {
+        expand(input, files);
+    }
+
+    LOG_INFO << L"Hashing " << files.size() << L" files on " << opts.threads << L" threads...";
+
+    std::atomic<std::size_t> next(0);
+    std::atomic<std::size_t> failed(0);
+    std::atomic<std::uint64_t> bytes(0);
+    boost::mutex output_mutex;
+    const auto started = std::chrono::steady_clock::now();
+
+    // Small files are dominated by opening and mapping them, so many are hashed at once, one per worker.
+    auto worker = [&]()
+        {
+            for (auto i = next++; i < files.size(); i = next++)
+            {
+                try
+                {
+                    const auto digest = pe_digest::compute(files[i], opts.digest_alg);
+
+                    WIN32_FILE_ATTRIBUTE_DATA data;
+                    if (::GetFileAttributesExW(files[i].c_str(), GetFileExInfoStandard, &data))
+                    {
+                        bytes += (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+                    }
+
+                    // Same format as the digest files written by signtool /dg, for comparing the two.
+                    std::wostringstream line;
+                    line << std::hex << std::uppercase << std::setfill(L'0');
+                    for (const auto c : digest)
+                    {
+                        line << std::setw(2) << static_cast<unsigned>(static_cast<BYTE>(c));
+                    }
+                    line << L"  " << files[i] << L'\n';
+
+                    boost::lock_guard<boost::mutex> lock(output_mutex);
+                    std::wcout << line.str();
+                }
+                catch (const std::exception& exc)
+                {
+                    ++failed;
+                    LOG_ERROR << L"Failed to hash " << files[i] << L": " << exc;
+                }
+            }
+        };
+
+    boost::thread_group workers;
+    const auto count = std::min<std::size_t>(opts.threads, files.size());
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        workers.create_thread(worker);
+    }
+    workers.join_all();
+    std::wcout.flush();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    const auto rate = elapsed.count() ? bytes / 1e6 / elapsed.count() : 0.0;
+    LOG_INFO << L"Hashed " << files.size() - failed << L" of " << files.size() << L" files, " << bytes / (1024 * 1024) << L" MB in " << elapsed.count() << L" ms (" << rate << L" GB/s)";
+
+    return failed;
+}
+
+}
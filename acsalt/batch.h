@@ -0,0 +1,35 @@
+#pragma once
+
+// Signs many files from one process. Every worker drives mssign32's SignerSignEx3 with this DLL's digest
+// callback, so all of them share one token, one connection pool and the cached certificate chain.
+namespace batch
+{
+    struct options
+    {
+        options() :
+            threads(32),
+            digest_alg(CALG_SHA_256)
+        {
+        }
+
+        // Number of files signed concurrently, i.e. sign operations in flight.
+        unsigned threads;
+        ALG_ID digest_alg;
+        // RFC 3161 servers, tried in order when one fails.
+        std::vector<std::wstring> timestamp_urls;
+        std::wstring metadata_file;
+
+        // Paths, wildcards or @list files with one path per line.
+        std::vector<std::wstring> inputs;
+    };
+
+    // Parses `[/j threads] [/fd sha256|sha384|sha512] [/tr url]... /dmdf metadata.json files...`, only run() needs /dmdf.
+    options parse_command_line(const std::wstring& command_line);
+
+    // Returns the number of files that failed to sign.
+    std::size_t run(const options& opts);
+
+    // Writes the Authenticode digest of every input to stdout, hashing `threads` files at a time, and logs the
+    // throughput. Returns the number of files that failed to hash.
+    std::size_t digest(const options& opts);
+}
@@ -0,0 +1,303 @@
+#include "pch.h"
+#include "broker.h"
+
+#include "context_cache.h"
+#include "encoder.h"
+#include "exception_strm.h"
+#include "file.h"
+#include "ipc_security.h"
+#include "logging.h"
+#include "scoped_cleanup.h"
+#include "trace.h"
+#include "win32_error.h"
+
+namespace
+{
+    const DWORD pipe_buffer_size = 64 * 1024;
+    const DWORD connect_timeout_ms = 5000;
+
+    // A client that connects and then never sends, or never reads, gives up its serve thread after this long.
+    const DWORD serve_io_timeout_ms = 10000;
+
+    // Reads or writes one chunk. The server end of the pipe is overlapped and passes a timeout, clients block.
+    BOOL transfer(HANDLE pipe, bool read, char* data, DWORD size, DWORD& transferred, DWORD timeout_ms)
+    {
+        if (timeout_ms == INFINITE)
+        {
+            return read ? ::ReadFile(pipe, data, size, &transferred, nullptr) : ::WriteFile(pipe, data, size, &transferred, nullptr);
+        }
+
+        file::handle event = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        if (!event)
+        {
+            throw win32_error("CreateEventW");
+        }
+
+        OVERLAPPED ov = {};
+        ov.hEvent = event;
+        const auto started = read ? ::ReadFile(pipe, data, size, nullptr, &ov) : ::WriteFile(pipe, data, size, nullptr, &ov);
+        if (!started && ::GetLastError() != ERROR_IO_PENDING)
+        {
+            return FALSE;
+        }
+
+        const auto wait = ::WaitForSingleObject(event, timeout_ms);
+        if (wait != WAIT_OBJECT_0)
+        {
+            const DWORD error = wait == WAIT_TIMEOUT ? ERROR_TIMEOUT : ::GetLastError();
+            ::CancelIoEx(pipe, &ov);
+            ::GetOverlappedResult(pipe, &ov, &transferred, TRUE);
+            throw std::system_error(error, std::system_category(), "Broker client did not complete the exchange in time.");
+        }
+
+        return ::GetOverlappedResult(pipe, &ov, &transferred, FALSE);
+    }
+
+    std::string read_message(HANDLE pipe, DWORD timeout_ms = INFINITE)
+    {
+        std::string message;
+        char buffer[4096];
+        for (;;)
+        {
+            DWORD read = 0;
+            if (transfer(pipe, true, buffer, sizeof(buffer), read, timeout_ms))
+            {
+                message.append(buffer, read);
+                return message;
+            }
+
+            if (::GetLastError() != ERROR_MORE_DATA)
+            {
+                throw win32_error("ReadFile");
+            }
+
+            message.append(buffer, read);
+        }
+    }
+
+    void write_message(HANDLE pipe, const std::string& message, DWORD timeout_ms = INFINITE)
+    {
+        DWORD written = 0;
+        if (!transfer(pipe, false, const_cast<char*>(message.data()), static_cast<DWORD>(message.size()), written, timeout_ms))
+        {
+            throw win32_error("WriteFile");
+        }
+    }
+
+    std::vector<BYTE> user_sid(HANDLE process)
+    {
+        HANDLE token = nullptr;
+        if (!::OpenProcessToken(process, TOKEN_QUERY, &token))
+        {
+            throw win32_error("OpenProcessToken");
+        }
+
+        const auto token_grd = scoped_cleanup([&token]() { ::CloseHandle(token); });
+
+        DWORD size = 0;
+        (void)::GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+        std::vector<BYTE> buffer(size, 0);
+        if (!::GetTokenInformation(token, TokenUser, buffer.data(), size, &size))
+        {
+            throw win32_error("GetTokenInformation");
+        }
+
+        const auto sid = reinterpret_cast<BYTE*>(reinterpret_cast<TOKEN_USER*>(buffer.data())->User.Sid);
+        return std::vector<BYTE>(sid, sid + ::GetLengthSid(sid));
+    }
+
+    // The request carries the client secret, so make sure the pipe was not squatted by another user.
+    bool server_is_same_user(HANDLE pipe)
+    {
+        ULONG pid = 0;
+        if (!::GetNamedPipeServerProcessId(pipe, &pid))
+        {
+            throw win32_error("GetNamedPipeServerProcessId");
+        }
+
+        HANDLE process = ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+        if (!process)
+        {
+            throw win32_error("OpenProcess");
+        }
+
+        const auto process_grd = scoped_cleanup([&process]() { ::CloseHandle(process); });
+
+        return user_sid(process) == user_sid(::GetCurrentProcess());
+    }
+
+    void serve(HANDLE pipe)
+    {
+        const auto pipe_grd = scoped_cleanup([pipe]()
+            {
+                // Gives the client time to read the response, the read ends when it hangs up. Unlike FlushFileBuffers
+                // this can't block for good.
+                try
+                {
+                    char byte = 0;
+                    DWORD read = 0;
+                    transfer(pipe, true, &byte, 1, read, serve_io_timeout_ms);
+                }
+                catch (const std::exception&)
+                {
+                }
+
+                ::DisconnectNamedPipe(pipe);
+                ::CloseHandle(pipe);
+                trace::flush();
+            });
+
+        const trace::span span("broker request");
+
+        boost::json::object response;
+        try
+        {
+            // Freed in one go with the request, the values are copied out below.
+            unsigned char buffer[4096];
+            boost::json::monotonic_resource arena(buffer, sizeof(buffer));
+            const auto request = boost::json::parse(read_message(pipe, serve_io_timeout_ms), &arena);
+            const auto blob = boost::json::value_to<std::string>(request.at("metadata"));
+            const auto alg_id = request.at("alg_id").to_number<unsigned>();
+            const auto digest = boost::json::value_to<std::string>(request.at("digest"));
+
+            const auto parsed = context_cache::instance().lookup(blob);
+            const auto& meta = *parsed;
+            const auto result = context_cache::instance().context(meta)->sign_digest(alg_id, digest, meta.endpoints, meta.account, meta.profile, meta.correlation_id);
+
+            response["signature"] = encoder::base64_encode(result.signature);
+            response["certificate"] = result.certificate;
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERROR << L"Broker request failed: " << exc;
+            response["error"] = exc.what();
+        }
+
+        try
+        {
+            write_message(pipe, boost::json::serialize(response), serve_io_timeout_ms);
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_ERROR << L"Failed to send broker response: " << exc;
+        }
+    }
+}
+
+namespace broker
+{
+
+std::wstring pipe_name()
+{
+    std::wstring user(256, 0);
+    DWORD size = static_cast<DWORD>(user.size());
+    if (!::GetUserNameW(&user[0], &size))
+    {
+        throw win32_error("GetUserNameW");
+    }
+    user.resize(size - 1);
+
+    return L"\\\\.\\pipe\\acsalt-broker-" + user;
+}
+
+bool sign_digest(const std::string& metadata_blob, unsigned alg_id, const std::string& digest, acs::signing_result& result)
+{
+    const auto name = pipe_name();
+
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    for (;;)
+    {
+        pipe = ::CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE)
+        {
+            break;
+        }
+
+        if (::GetLastError() != ERROR_PIPE_BUSY || !::WaitNamedPipeW(name.c_str(), connect_timeout_ms))
+        {
+            LOG_WARNING << L"Signing broker is not available, signing in-process.";
+            return false;
+        }
+    }
+
+    file::handle pipe_handle(pipe);
+
+    if (!server_is_same_user(pipe_handle))
+    {
+        LOG_WARNING << L"Signing broker runs as a different user, signing in-process.";
+        return false;
+    }
+
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    if (!::SetNamedPipeHandleState(pipe_handle, &mode, nullptr, nullptr))
+    {
+        throw win32_error("SetNamedPipeHandleState");
+    }
+
+    LOG_INFO << L"Forwarding digest to signing broker...";
+
+    boost::json::object request;
+    request["metadata"] = metadata_blob;
+    request["alg_id"] = alg_id;
+    request["digest"] = digest;
+    write_message(pipe_handle, boost::json::serialize(request));
+
+    const auto response = boost::json::parse(read_message(pipe_handle));
+    const auto error = response.as_object().if_contains("error");
+    if (error)
+    {
+        throw std::runtime_error("Signing broker failed: " + boost::json::value_to<std::string>(*error));
+    }
+
+    result.signature = encoder::base64_decode(boost::json::value_to<std::string>(response.at("signature")));
+    result.certificate = boost::json::value_to<std::string>(response.at("certificate"));
+    return true;
+}
+
+void run()
+{
+    const auto name = pipe_name();
+    LOG_INFO << L"Signing broker listening on " << name;
+
+    file::handle connected = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!connected)
+    {
+        throw win32_error("CreateEventW");
+    }
+
+    // Serve threads time out on clients that stall, which takes overlapped I/O on the server end.
+    DWORD first_instance = FILE_FLAG_FIRST_PIPE_INSTANCE;
+    for (;;)
+    {
+        // Restricted to the user like the other shared objects, so other accounts can't even connect.
+        HANDLE pipe = ::CreateNamedPipeW(name.c_str(),
+                                         PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | first_instance,
+                                         PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                         PIPE_UNLIMITED_INSTANCES,
+                                         pipe_buffer_size,
+                                         pipe_buffer_size,
+                                         0,
+                                         ipc_security::owner_only_attributes());
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            throw win32_error("CreateNamedPipeW");
+        }
+
+        first_instance = 0;
+
+        OVERLAPPED ov = {};
+        ov.hEvent = connected;
+        DWORD unused = 0;
+        if (!::ConnectNamedPipe(pipe, &ov) && ::GetLastError() != ERROR_PIPE_CONNECTED &&
+            (::GetLastError() != ERROR_IO_PENDING || !::GetOverlappedResult(pipe, &ov, &unused, TRUE)))
+        {
+            LOG_ERROR << L"ConnectNamedPipe failed: " << win32_error("ConnectNamedPipe");
+            ::CloseHandle(pipe);
+            continue;
+        }
+
+        boost::thread(&serve, pipe).detach();
+    }
+}
+
+}
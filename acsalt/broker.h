@@ -0,0 +1,16 @@
+#pragma once
+
+#include "acs.h"
+
+// Resident signing broker. One long-lived process owns the tokens and connections and signs on behalf of
+// every signtool instance of the same user, which talk to it through a named pipe.
+namespace broker
+{
+    std::wstring pipe_name();
+
+    // Forwards the digest to the running broker. Returns false if there is none, the caller signs in-process then.
+    bool sign_digest(const std::string& metadata_blob, unsigned alg_id, const std::string& digest, acs::signing_result& result);
+
+    // Serves signing requests until the process is terminated.
+    void run();
+}
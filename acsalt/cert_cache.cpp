@@ -0,0 +1,107 @@
+#include "pch.h"
+#include "cert_cache.h"
+
+#include "encoder.h"
+#include "win32_error.h"
+
+namespace
+{
+    const char* const code_signing_eku = "1.3.6.1.5.5.7.3.3";
+
+    // A profile has one chain at a time, a few more cover certificate renewals and several profiles.
+    const std::size_t max_chains = 16;
+
+    bool is_code_signing(PCCERT_CONTEXT context)
+    {
+        DWORD size = 0;
+        if (!::CertGetEnhancedKeyUsage(context, 0, nullptr, &size))
+        {
+            return false;
+        }
+
+        std::vector<BYTE> buffer(size, 0);
+        auto eku = reinterpret_cast<PCERT_ENHKEY_USAGE>(buffer.data());
+        if (!::CertGetEnhancedKeyUsage(context, 0, eku, &size))
+        {
+            return false;
+        }
+
+        for (DWORD i = 0; i < eku->cUsageIdentifier; ++i)
+        {
+            if (boost::equals(eku->rgpszUsageIdentifier[i], code_signing_eku))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+cert_chain::cert_chain(const std::string& encoded) :
+    store_(nullptr)
+{
+    auto decoded = encoder::base64_decode(encoded);
+
+    CERT_BLOB blob;
+    blob.cbData = static_cast<DWORD>(decoded.size());
+    blob.pbData = reinterpret_cast<BYTE*>(&decoded[0]);
+
+    if (!::CryptQueryObject(CERT_QUERY_OBJECT_BLOB, &blob, CERT_QUERY_CONTENT_FLAG_ALL, CERT_QUERY_FORMAT_FLAG_ALL, 0, nullptr, nullptr, nullptr, &store_, nullptr, nullptr))
+    {
+        throw win32_error("CryptQueryObject");
+    }
+
+    // The contexts stay valid as long as the store is open.
+    PCCERT_CONTEXT context = nullptr;
+    while (nullptr != (context = ::CertEnumCertificatesInStore(store_, context)))
+    {
+        certificates_.emplace_back(::CertDuplicateCertificateContext(context), is_code_signing(context));
+    }
+}
+
+cert_chain::~cert_chain()
+{
+    for (const auto& certificate : certificates_)
+    {
+        ::CertFreeCertificateContext(certificate.first);
+    }
+    ::CertCloseStore(store_, 0);
+}
+
+void cert_chain::add_to(HCERTSTORE store, PCCERT_CONTEXT* signer) const
+{
+    for (const auto& certificate : certificates_)
+    {
+        ::CertAddCertificateContextToStore(store, certificate.first, CERT_STORE_ADD_NEW, certificate.second ? signer : nullptr);
+    }
+}
+
+cert_cache& cert_cache::instance()
+{
+    static cert_cache cache;
+    return cache;
+}
+
+std::shared_ptr<const cert_chain> cert_cache::lookup(const std::string& encoded)
+{
+    const auto key = std::hash<std::string>()(encoded);
+
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        const auto it = chains_.find(key);
+        if (it != chains_.end() && it->second.first == encoded)
+        {
+            return it->second.second;
+        }
+    }
+
+    const auto chain = std::make_shared<cert_chain>(encoded);
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (chains_.size() >= max_chains)
+    {
+        chains_.clear();
+    }
+    chains_[key] = std::make_pair(encoded, chain);
+    return chain;
+}
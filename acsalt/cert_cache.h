@@ -0,0 +1,34 @@
+#pragma once
+
+// Signing certificate chain parsed out of the PKCS#7 blob returned by the service.
+class cert_chain : boost::noncopyable
+{
+public:
+    // `encoded` is the base64 blob as sent by the service.
+    explicit cert_chain(const std::string& encoded);
+
+    ~cert_chain();
+
+    // Adds all certificates to `store`, the code signing one is returned through `signer`.
+    void add_to(HCERTSTORE store, PCCERT_CONTEXT* signer) const;
+
+private:
+    HCERTSTORE store_;
+    std::vector<std::pair<PCCERT_CONTEXT, bool>> certificates_;
+};
+
+// The service returns the same chain for a profile for weeks, so chains are parsed once per process and
+// looked up by the blob afterwards.
+class cert_cache : boost::noncopyable
+{
+public:
+    static cert_cache& instance();
+
+    std::shared_ptr<const cert_chain> lookup(const std::string& encoded);
+
+private:
+    cert_cache() = default;
+
+    boost::shared_mutex mutex_;
+    std::map<std::size_t, std::pair<std::string, std::shared_ptr<const cert_chain>>> chains_;
+};
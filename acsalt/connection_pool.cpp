@@ -0,0 +1,203 @@
+#include "pch.h"
+#include "connection_pool.h"
+#include "scoped_cleanup.h"
+#include "win32_error.h"
+
+#pragma comment(lib, "winhttp")
+
+namespace
+{
+    void set_secure_protocols(HINTERNET session)
+    {
+        DWORD protocols = WINHTTP_FLAG_SECURE_PROTOCOL_TLS1 | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_1 | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2;
+
+#ifdef WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_3
+        // TLS 1.3 saves a round trip on full handshakes and resumes with session tickets. Systems without it
+        // reject the flag and get the older protocols only.
+        DWORD with_tls13 = protocols | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_3;
+        if (::WinHttpSetOption(session, WINHTTP_OPTION_SECURE_PROTOCOLS, &with_tls13, sizeof(with_tls13)))
+        {
+            return;
+        }
+#endif
+
+        if (!::WinHttpSetOption(session, WINHTTP_OPTION_SECURE_PROTOCOLS, &protocols, sizeof(protocols)))
+        {
+            throw win32_error("WinHttpSetOption");
+        }
+    }
+}
+
+bool connection_pool::key::operator<(const key& other) const
+{
+    return std::tie(scheme, host, port, proxy, separate) < std::tie(other.scheme, other.host, other.port, other.proxy, other.separate);
+}
+
+connection_pool::lease::lease(connection_pool& pool, entry_map::iterator it) :
+    pool_(&pool),
+    it_(it)
+{
+}
+
+connection_pool::lease::lease(lease&& other) :
+    pool_(other.pool_),
+    it_(other.it_)
+{
+    other.pool_ = nullptr;
+}
+
+connection_pool::lease::~lease()
+{
+    if (pool_)
+    {
+        pool_->release(it_);
+    }
+}
+
+HINTERNET connection_pool::lease::connection() const
+{
+    return it_->second.connection;
+}
+
+void connection_pool::lease::negotiated(bool http2) const
+{
+    pool_->negotiated(it_, http2);
+}
+
+connection_pool::connection_pool(unsigned max_per_host, unsigned max_streams_per_host, std::chrono::seconds idle_timeout) :
+    max_per_host_(max_per_host),
+    max_streams_per_host_(max_streams_per_host),
+    idle_timeout_(idle_timeout)
+{
+}
+
+connection_pool::~connection_pool()
+{
+    for (auto& kvp : entries_)
+    {
+        close(kvp.second);
+    }
+
+    for (const auto& kvp : sessions_)
+    {
+        ::WinHttpCloseHandle(kvp.second);
+    }
+}
+
+connection_pool::lease connection_pool::acquire(const key& key)
+{
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    auto it = entries_.find(key);
+    if (it != entries_.end())
+    {
+        while (it->second.in_flight >= it->second.max_in_flight)
+        {
+            released_.wait(lock);
+        }
+
+        ++it->second.in_flight;
+        return lease(*this, it);
+    }
+
+    auto connection = ::WinHttpConnect(session(key.proxy, key.separate), key.host.c_str(), key.port, 0);
+    if (!connection)
+    {
+        throw win32_error("WinHttpConnect");
+    }
+
+    entry e;
+    e.connection = connection;
+    e.in_flight = 1;
+
+    // Enabling HTTP/2 on the session only offers it through ALPN. Until a response shows the server took it,
+    // further requests would just queue inside WinHTTP behind MAX_CONNS_PER_SERVER with their timeouts running.
+    e.max_in_flight = max_per_host_;
+    e.last_used = std::chrono::steady_clock::now();
+
+    return lease(*this, entries_.insert(std::make_pair(key, e)).first);
+}
+
+void connection_pool::evict_idle()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = entries_.begin(); it != entries_.end();)
+    {
+        if (it->second.in_flight == 0 && now - it->second.last_used > idle_timeout_)
+        {
+            close(it->second);
+            it = entries_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void connection_pool::release(entry_map::iterator it)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        --it->second.in_flight;
+        it->second.last_used = std::chrono::steady_clock::now();
+    }
+
+    released_.notify_all();
+}
+
+void connection_pool::negotiated(entry_map::iterator it, bool http2)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        it->second.max_in_flight = http2 ? max_streams_per_host_ : max_per_host_;
+    }
+
+    released_.notify_all();
+}
+
+void connection_pool::close(entry& e)
+{
+    ::WinHttpCloseHandle(e.connection);
+}
+
+HINTERNET connection_pool::session(const std::wstring& proxy, bool separate)
+{
+    const auto it = sessions_.find(std::make_pair(proxy, separate));
+    if (it != sessions_.end())
+    {
+        return it->second;
+    }
+
+    auto session = ::WinHttpOpen(L"azhttp",
+                                 proxy.empty() ? WINHTTP_ACCESS_TYPE_NO_PROXY : WINHTTP_ACCESS_TYPE_NAMED_PROXY,
+                                 proxy.empty() ? WINHTTP_NO_PROXY_NAME : proxy.c_str(),
+                                 WINHTTP_NO_PROXY_BYPASS,
+                                 0);
+    if (!session)
+    {
+        throw win32_error("WinHttpOpen");
+    }
+
+    auto session_grd = scoped_cleanup([&session]() { ::WinHttpCloseHandle(session); });
+
+    set_secure_protocols(session);
+
+    // WinHTTP keeps the sockets of a session alive on its own, this only caps how many it opens per server.
+    DWORD options = max_per_host_;
+    if (!::WinHttpSetOption(session, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &options, sizeof(options)))
+    {
+        throw win32_error("WinHttpSetOption");
+    }
+
+    // Lets WinHTTP negotiate HTTP/2 through ALPN. Concurrent submits and polls then share one TLS connection and
+    // the repeated Authorization header is HPACK-compressed. Systems older than Windows 10 1607 reject the option
+    // and stay on HTTP/1.1.
+    options = WINHTTP_PROTOCOL_FLAG_HTTP2;
+    (void)::WinHttpSetOption(session, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &options, sizeof(options));
+
+    session_grd.dismiss();
+    return sessions_[std::make_pair(proxy, separate)] = session;
+}
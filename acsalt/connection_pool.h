@@ -0,0 +1,95 @@
+#pragma once
+
+#include <winhttp.h>
+
+// Keeps WinHTTP sessions open between requests, so the keep-alive sockets (and the TLS sessions on them)
+// are reused by the login, the submit and all the polls instead of being re-established every time.
+// Sessions outlive idle connection handles, so a socket closed in between still resumes its TLS session.
+class connection_pool : boost::noncopyable
+{
+public:
+    struct key
+    {
+        INTERNET_SCHEME scheme;
+        std::wstring host;
+        INTERNET_PORT port;
+        std::wstring proxy;
+
+        // Connects through a session of its own. WinHTTP pools sockets (and multiplexes HTTP/2) per session rather
+        // than per connect handle, so only a second session is guaranteed another TCP and TLS connection.
+        bool separate;
+
+        bool operator<(const key& other) const;
+    };
+
+private:
+    struct entry
+    {
+        HINTERNET connection;
+        unsigned in_flight;
+        unsigned max_in_flight;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    typedef std::map<key, entry> entry_map;
+
+public:
+    class lease
+    {
+    public:
+        lease(lease&& other);
+
+        ~lease();
+
+        HINTERNET connection() const;
+
+        // Reports the protocol of a completed response. Connections start out with the HTTP/1.1 cap and only
+        // admit max_streams_per_host once the server has actually answered over HTTP/2.
+        void negotiated(bool http2) const;
+
+    private:
+        friend class connection_pool;
+
+        lease(connection_pool& pool, entry_map::iterator it);
+
+        lease(const lease&) = delete;
+        lease& operator=(const lease&) = delete;
+
+        connection_pool* pool_;
+        entry_map::iterator it_;
+    };
+
+    // With HTTP/2 requests are multiplexed as streams over one connection, so more of them may be in flight once
+    // the server is known to speak it.
+    connection_pool(unsigned max_per_host = 8, unsigned max_streams_per_host = 100, std::chrono::seconds idle_timeout = std::chrono::seconds(60));
+
+    ~connection_pool();
+
+    // Blocks while max_per_host (or max_streams_per_host with negotiated HTTP/2) requests to the same key are
+    // already in flight.
+    lease acquire(const key& key);
+
+    void evict_idle();
+
+private:
+    void release(entry_map::iterator it);
+
+    void negotiated(entry_map::iterator it, bool http2);
+
+    void close(entry& e);
+
+    // Callers must hold the mutex.
+    HINTERNET session(const std::wstring& proxy, bool separate);
+
+    const unsigned max_per_host_;
+    const unsigned max_streams_per_host_;
+    const std::chrono::seconds idle_timeout_;
+
+    boost::mutex mutex_;
+    boost::condition_variable released_;
+    entry_map entries_;
+
+    // Sessions hold the Schannel credentials and with them the TLS session cache, so they are kept for the
+    // lifetime of the pool. Idle sockets are closed by WinHTTP on its own.
+    std::map<std::pair<std::wstring, bool>, HINTERNET> sessions_;
+};
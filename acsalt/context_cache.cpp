@@ -0,0 +1,75 @@
+#include "pch.h"
+#include "context_cache.h"
+#include "logging.h"
+
+namespace
+{
+    // Blobs usually differ only in the correlation id, so the parsed entries are dropped wholesale past this
+    // size. The contexts are keyed by credentials and survive that.
+    const std::size_t max_entries = 64;
+}
+
+context_cache& context_cache::instance()
+{
+    // Intentionally leaked: the contexts own threads that can't be joined from DllMain during process detach.
+    static context_cache* cache = new context_cache();
+    return *cache;
+}
+
+std::shared_ptr<const metadata> context_cache::lookup(const std::string& blob)
+{
+    const auto key = std::hash<std::string>()(blob);
+
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        const auto it = entries_.find(key);
+        if (it != entries_.end() && it->second.first == blob)
+        {
+            return it->second.second;
+        }
+    }
+
+    // Parse outside of the lock, metadata::parse throws on malformed blobs.
+    const auto meta = std::make_shared<const metadata>(metadata::parse(blob));
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (entries_.size() >= max_entries)
+    {
+        entries_.clear();
+    }
+    entries_[key] = std::make_pair(blob, meta);
+    return meta;
+}
+
+std::shared_ptr<acs> context_cache::context(const metadata& meta)
+{
+    const auto key = meta.authority + L'\n' + meta.tenant + L'\n' + meta.client_id;
+
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        const auto it = contexts_.find(key);
+        if (it != contexts_.end() && it->second.context && it->second.secret == meta.secret)
+        {
+            return it->second.context;
+        }
+    }
+
+    // A replaced context is destroyed after the lock is released, it waits for its background login to finish.
+    std::shared_ptr<acs> replaced;
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    auto& creds = contexts_[key];
+    if (!creds.context || creds.secret != meta.secret)
+    {
+        if (creds.context)
+        {
+            LOG_INFO << L"Client credentials changed, dropping the cached signing context.";
+            replaced = std::move(creds.context);
+        }
+
+        // Callers still holding the old context finish with it, it is released with the last reference.
+        creds.secret = meta.secret;
+        creds.context = std::make_shared<acs>(meta.authority, meta.tenant, meta.client_id, meta.secret);
+    }
+    return creds.context;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "acs.h"
+#include "metadata.h"
+
+// Process-wide cache of parsed metadata and signing contexts. Repeated calls with the same metadata reuse the
+// parsed configuration; concurrent calls with the same credentials share one acs instance, and with it the token
+// and the pooled connections.
+class context_cache : boost::noncopyable
+{
+public:
+    static context_cache& instance();
+
+    // Parses the blob on first use.
+    std::shared_ptr<const metadata> lookup(const std::string& blob);
+
+    // Creates the context on first use, so processes that sign through the broker never start one. Metadata with
+    // the same tenant and client id but another secret replaces the old context, so rotated credentials don't keep
+    // using the old token.
+    std::shared_ptr<acs> context(const metadata& meta);
+
+private:
+    context_cache() = default;
+
+    struct credentials
+    {
+        std::wstring secret;
+        std::shared_ptr<acs> context;
+    };
+
+    boost::shared_mutex mutex_;
+    std::map<std::size_t, std::pair<std::string, std::shared_ptr<const metadata>>> entries_;
+    std::map<std::wstring, credentials> contexts_;
+};
@@ -6,27 +6,39 @@ namespace {
 
     const int entropy_bytes = 128;
 
-    template <typename CharT>
-    std::basic_string<CharT> url_encode_internal(const std::basic_string<CharT>& str)
+    struct url_table_t
     {
-        std::basic_ostringstream<CharT> escaped;
-        escaped.fill('0');
-        escaped << std::hex;
+        url_table_t()
+        {
+            for (unsigned c = 0; c < 0x80; ++c)
+            {
+                unreserved[c] = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.' || c == '~';
+            }
+        }
+
+        bool unreserved[0x80];
+    };
 
+    const url_table_t url_table;
+
+    const char hex_digits[] = "0123456789ABCDEF";
+
+    template <typename CharT>
+    void url_encode_internal(const std::basic_string<CharT>& str, std::basic_string<CharT>& out)
+    {
         for (const auto c : str)
         {
-            if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+            const auto code = static_cast<typename std::make_unsigned<CharT>::type>(c);
+            if (code < 0x80 && url_table.unreserved[code])
             {
-                escaped << c;
+                out.push_back(c);
                 continue;
             }
 
-            escaped << std::uppercase;
-            escaped << '%' << std::setw(2) << int((unsigned char)c);
-            escaped << std::nouppercase;
+            out.push_back(CharT('%'));
+            out.push_back(CharT(hex_digits[(code >> 4) & 0xf]));
+            out.push_back(CharT(hex_digits[code & 0xf]));
         }
-
-        return escaped.str();
     }
 
     std::string generate_entropy(unsigned num_bytes)
@@ -59,48 +71,30 @@ namespace {
 
 namespace encoder {
 
-std::string base64_encode(LPCBYTE buffer, DWORD size)
+std::wstring url_encode(const std::wstring& str)
 {
-    const DWORD flags = CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF;
-    DWORD outsize = 0;
-    (void)::CryptBinaryToStringA(buffer, size, flags, NULL, &outsize);
-    std::string out(outsize, 0);
-    if (!::CryptBinaryToStringA(buffer, size, flags, &out[0], &outsize))
-    {
-        throw win32_error("CryptBinaryToStringA");
-    }
-    out.pop_back(); // remove null terminator
-
+    std::wstring out;
+    out.reserve(str.size());
+    url_encode_internal(str, out);
     return out;
 }
 
-std::string base64_encode(const std::string& input)
-{
-    return base64_encode(reinterpret_cast<LPCBYTE>(input.data()), static_cast<DWORD>(input.size()));
-}
-
-std::string base64_decode(const std::string& input)
+std::string url_encode(const std::string& str)
 {
-    const DWORD flags = CRYPT_STRING_BASE64;
-    DWORD outsize = 0;
-    (void)::CryptStringToBinaryA(input.c_str(), 0, flags, NULL, &outsize, NULL, NULL);
-    std::string out(outsize, 0);
-    if (!::CryptStringToBinaryA(input.c_str(), 0, flags, reinterpret_cast<BYTE*>(&out[0]), &outsize, NULL, NULL))
-    {
-        throw win32_error("CryptStringToBinaryA");
-    }
-
+    std::string out;
+    out.reserve(str.size());
+    url_encode_internal(str, out);
     return out;
 }
 
-std::wstring url_encode(const std::wstring& str)
+void url_encode(const std::wstring& str, std::wstring& out)
 {
-    return url_encode_internal(str);
+    url_encode_internal(str, out);
 }
 
-std::string url_encode(const std::string& str)
+void url_encode(const std::string& str, std::string& out)
 {
-    return url_encode_internal(str);
+    url_encode_internal(str, out);
 }
 
 std::wstring to_wstring(const std::string& s, int codepage)
@@ -2,6 +2,18 @@
 
 namespace encoder
 {
+    std::size_t base64_encoded_size(std::size_t size);
+
+    // Upper bound, whitespace and padding in the input make the actual size smaller.
+    std::size_t base64_decoded_size(std::size_t size);
+
+    // Writes exactly base64_encoded_size(size) characters. Returns the number of characters written.
+    std::size_t base64_encode(const BYTE* input, std::size_t size, char* output);
+
+    // Accepts line breaks and blanks between characters and missing padding. Returns the number of bytes written.
+    // Any capacity that fits the output works, 32 extra bytes let the vector code run up to the end of the input.
+    std::size_t base64_decode(const char* input, std::size_t size, BYTE* output, std::size_t capacity);
+
     std::string base64_encode(LPCBYTE buffer, DWORD size);
 
     std::string base64_encode(const std::string& input);
@@ -12,6 +24,11 @@ namespace encoder
 
     std::string url_encode(const std::string& str);
 
+    // Appends the encoded string to `out`, so callers can reuse one buffer.
+    void url_encode(const std::wstring& str, std::wstring& out);
+
+    void url_encode(const std::string& str, std::string& out);
+
     std::wstring to_wstring(const std::string& s, int codepage = CP_ACP);
 
     std::string to_string(const std::wstring& s, int codepage = CP_ACP);
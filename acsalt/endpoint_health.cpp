@@ -0,0 +1,133 @@
+#include "pch.h"
+#include "endpoint_health.h"
+
+#include "ipc_security.h"
+
+namespace
+{
+    const std::size_t max_endpoints = 32;
+
+    // Weight of the latest sample in the moving averages.
+    const double ewma_alpha = 0.2;
+
+    // Added to the latency at full error rate, an endpoint failing every request scores like one answering after
+    // the request timeout. Additive, so failures that come back fast don't make a region look good.
+    const double error_penalty_ms = 30 * 1000.0;
+
+    // Scores older than this are forgotten, so a region that recovered is tried again.
+    const ULONGLONG stale_ms = 5 * 60 * 1000;
+}
+
+struct endpoint_health::state
+{
+    struct endpoint
+    {
+        std::uint64_t key;
+        double latency_ms;
+        double error_rate;
+        ULONGLONG updated;
+    };
+
+    state()
+    {
+        std::memset(endpoints, 0, sizeof(endpoints));
+    }
+
+    endpoint* find(std::uint64_t key)
+    {
+        for (auto& e : endpoints)
+        {
+            if (e.key == key)
+            {
+                return &e;
+            }
+        }
+        return nullptr;
+    }
+
+    // Reuses the least recently updated entry when all are taken.
+    endpoint* find_or_add(std::uint64_t key)
+    {
+        auto e = find(key);
+        if (e)
+        {
+            return e;
+        }
+
+        e = &*std::min_element(std::begin(endpoints), std::end(endpoints), [](const endpoint& a, const endpoint& b) { return a.updated < b.updated; });
+        std::memset(e, 0, sizeof(*e));
+        e->key = key;
+        return e;
+    }
+
+    boost::interprocess::interprocess_mutex mutex;
+    endpoint endpoints[max_endpoints];
+};
+
+endpoint_health& endpoint_health::instance()
+{
+    static endpoint_health health;
+    return health;
+}
+
+endpoint_health::endpoint_health() :
+    shm_(boost::interprocess::open_or_create, ipc_security::object_name("acsalt-endpoints").c_str(), 64 * 1024, nullptr, ipc_security::owner_only()),
+    state_(shm_.find_or_construct<state>("state")())
+{
+}
+
+std::vector<std::string> endpoint_health::rank(const std::vector<std::string>& endpoints)
+{
+    if (endpoints.size() < 2)
+    {
+        return endpoints;
+    }
+
+    std::vector<std::pair<double, std::string>> scored;
+    {
+        boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+
+        const auto now = ::GetTickCount64();
+        for (const auto& endpoint : endpoints)
+        {
+            const auto e = state_->find(std::hash<std::string>()(endpoint));
+            const bool known = e && now - e->updated < stale_ms;
+            scored.emplace_back(known ? e->latency_ms + error_penalty_ms * e->error_rate : 0.0, endpoint);
+        }
+    }
+
+    std::stable_sort(scored.begin(), scored.end(), [](const std::pair<double, std::string>& a, const std::pair<double, std::string>& b) { return a.first < b.first; });
+
+    std::vector<std::string> ranked;
+    ranked.reserve(scored.size());
+    for (auto& s : scored)
+    {
+        ranked.push_back(std::move(s.second));
+    }
+    return ranked;
+}
+
+void endpoint_health::report(const std::string& endpoint, std::chrono::milliseconds latency, bool failed)
+{
+    boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+
+    auto e = state_->find_or_add(std::hash<std::string>()(endpoint));
+    const auto now = ::GetTickCount64();
+    const auto sample = static_cast<double>(latency.count());
+    // Only successful exchanges are timed, failures often come back fast and would make a failing region look
+    // quick. Zero means no successful sample yet.
+    if (!e->updated || now - e->updated >= stale_ms)
+    {
+        e->latency_ms = failed ? 0.0 : sample;
+        e->error_rate = failed ? 1.0 : 0.0;
+    }
+    else
+    {
+        if (!failed)
+        {
+            e->latency_ms = e->latency_ms ? e->latency_ms + ewma_alpha * (sample - e->latency_ms) : sample;
+        }
+        e->error_rate += ewma_alpha * ((failed ? 1.0 : 0.0) - e->error_rate);
+    }
+    e->updated = now;
+}
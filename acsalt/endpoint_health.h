@@ -0,0 +1,24 @@
+#pragma once
+
+// Latency and error rate of each signing endpoint, shared by all processes through a named segment. Regions
+// that are slow or failing are moved to the back of the list, endpoints without recent measurements to the
+// front so they get measured.
+class endpoint_health : boost::noncopyable
+{
+public:
+    // Opens or creates the shared segment on first use.
+    static endpoint_health& instance();
+
+    // Returns `endpoints` best first. Equal scores keep the given order.
+    std::vector<std::string> rank(const std::vector<std::string>& endpoints);
+
+    void report(const std::string& endpoint, std::chrono::milliseconds latency, bool failed);
+
+private:
+    endpoint_health();
+
+    struct state;
+
+    boost::interprocess::managed_windows_shared_memory shm_;
+    state* state_;
+};
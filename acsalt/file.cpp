@@ -62,5 +62,20 @@ void write(const std::wstring& path, const std::string& data)
     }
 }
 
+void append(const std::wstring& path, const std::string& data)
+{
+    handle file = ::CreateFileW(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (!file.valid())
+    {
+        throw win32_error("CreateFileW");
+    }
+
+    DWORD written = 0;
+    if (!::WriteFile(file, data.data(), static_cast<DWORD>(data.size()), &written, nullptr))
+    {
+        throw win32_error("WriteFile");
+    }
+}
+
 }
 
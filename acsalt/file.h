@@ -20,5 +20,8 @@ namespace file
 
     void write(const std::wstring& path, const std::string& data);
 
+    // Creates the file if needed, concurrent appenders don't overwrite each other.
+    void append(const std::wstring& path, const std::string& data);
+
 }
 
@@ -0,0 +1,91 @@
+#pragma once
+
+// Case-insensitive header collection with the part of the std::map interface the transports use. Requests and
+// responses carry a handful of headers, so they live in one inline vector and are found by a linear scan
+// instead of being spread over map nodes.
+class flat_headers
+{
+public:
+    typedef std::pair<std::wstring, std::wstring> value_type;
+    typedef boost::container::small_vector<value_type, 8> container;
+    typedef container::iterator iterator;
+    typedef container::const_iterator const_iterator;
+
+    iterator begin()
+    {
+        return items_.begin();
+    }
+
+    iterator end()
+    {
+        return items_.end();
+    }
+
+    const_iterator begin() const
+    {
+        return items_.begin();
+    }
+
+    const_iterator end() const
+    {
+        return items_.end();
+    }
+
+    bool empty() const
+    {
+        return items_.empty();
+    }
+
+    std::size_t size() const
+    {
+        return items_.size();
+    }
+
+    void reserve(std::size_t count)
+    {
+        items_.reserve(count);
+    }
+
+    iterator find(const std::wstring& name)
+    {
+        return std::find_if(items_.begin(), items_.end(), [&name](const value_type& item) { return boost::iequals(item.first, name); });
+    }
+
+    const_iterator find(const std::wstring& name) const
+    {
+        return std::find_if(items_.begin(), items_.end(), [&name](const value_type& item) { return boost::iequals(item.first, name); });
+    }
+
+    std::wstring& operator[](const std::wstring& name)
+    {
+        const auto it = find(name);
+        if (it != items_.end())
+        {
+            return it->second;
+        }
+
+        items_.emplace_back(name, std::wstring());
+        return items_.back().second;
+    }
+
+    // Like std::map, a repeated header keeps its first value.
+    std::pair<iterator, bool> emplace(std::wstring name, std::wstring value)
+    {
+        const auto it = find(name);
+        if (it != items_.end())
+        {
+            return std::make_pair(it, false);
+        }
+
+        items_.emplace_back(std::move(name), std::move(value));
+        return std::make_pair(items_.end() - 1, true);
+    }
+
+    void swap(flat_headers& other)
+    {
+        items_.swap(other.items_);
+    }
+
+private:
+    container items_;
+};
@@ -0,0 +1,78 @@
+#include "pch.h"
+#include "hedge_policy.h"
+
+namespace
+{
+    const std::size_t max_samples = 128;
+
+    // Until there are this many samples the default delay applies.
+    const std::size_t min_samples = 16;
+
+    const double percentile = 0.95;
+
+    const std::chrono::milliseconds default_delay(2000);
+    const std::chrono::milliseconds min_delay(50);
+
+    // Every request earns this much of a hedge, unused hedges add up to at most max_budget.
+    const double budget_per_request = 0.05;
+    const double max_budget = 10.0;
+
+    std::wstring host_of(const std::wstring& url)
+    {
+        const auto scheme = url.find(L"://");
+        const auto begin = scheme == url.npos ? 0 : scheme + 3;
+        return url.substr(begin, url.find(L'/', begin) - begin);
+    }
+}
+
+hedge_policy::hedge_policy() :
+    budget_(1.0)
+{
+}
+
+std::chrono::milliseconds hedge_policy::delay(const std::wstring& url)
+{
+    std::vector<std::chrono::milliseconds> latencies;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        budget_ = std::min(budget_ + budget_per_request, max_budget);
+
+        const auto it = hosts_.find(host_of(url));
+        if (it == hosts_.end() || it->second.latencies.size() < min_samples)
+        {
+            return default_delay;
+        }
+        latencies = it->second.latencies;
+    }
+
+    const auto nth = latencies.begin() + static_cast<std::ptrdiff_t>(percentile * (latencies.size() - 1));
+    std::nth_element(latencies.begin(), nth, latencies.end());
+    return std::max(*nth, min_delay);
+}
+
+bool hedge_policy::try_acquire()
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (budget_ < 1.0)
+    {
+        return false;
+    }
+
+    budget_ -= 1.0;
+    return true;
+}
+
+void hedge_policy::record(const std::wstring& url, std::chrono::milliseconds latency)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    auto& s = hosts_[host_of(url)];
+    if (s.latencies.size() < max_samples)
+    {
+        s.latencies.push_back(latency);
+    }
+    else
+    {
+        s.latencies[s.next] = latency;
+        s.next = (s.next + 1) % max_samples;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Decides when an idempotent request gets a second copy. The delay tracks a high percentile of recent
+// latencies per host, so only the slowest few percent are hedged, and a budget caps hedges to a fraction of
+// the requests even when a whole host slows down.
+class hedge_policy : boost::noncopyable
+{
+public:
+    hedge_policy();
+
+    // How long to wait for the first copy before sending the second one. Called once per request, which
+    // also adds to the budget.
+    std::chrono::milliseconds delay(const std::wstring& url);
+
+    // Takes a hedge from the budget. Returns false if there is none left.
+    bool try_acquire();
+
+    void record(const std::wstring& url, std::chrono::milliseconds latency);
+
+private:
+    struct samples
+    {
+        samples() :
+            next(0)
+        {
+        }
+
+        std::vector<std::chrono::milliseconds> latencies;
+        std::size_t next;
+    };
+
+    boost::mutex mutex_;
+    std::map<std::wstring, samples> hosts_;
+    double budget_;
+};
@@ -1,276 +1,330 @@
 #include "pch.h"
 #include "exception_strm.h"
 #include "http_client.h"
+#include "logging.h"
 #include "scoped_cleanup.h"
 #include "win32_error.h"
+#include "winhttp_transport.h"
 
-#include <deque>
-#include <winhttp.h>
-#pragma comment(lib, "winhttp")
-
-const DWORD http_client::status_unknown = static_cast<DWORD>(-1);
-
-http_client::http_client() :
-    timeouts_(30, 30, 30, 30)
-{
-}
-
-void http_client::timeouts(int resolve, int connect, int send, int receive)
-{
-    timeouts_ = std::make_tuple(resolve, connect, send, receive);
-}
-
-std::tuple<int, int, int, int> http_client::timeouts() const
-{
-    return timeouts_;
-}
-
-void http_client::proxy(const std::wstring& proxy)
-{
-    proxy_ = proxy;
-}
-
-std::wstring http_client::proxy() const
-{
-    return proxy_;
-}
-
-http_client::response http_client::get(const std::wstring& url, const header_map& headers, unsigned retries)
-{
-    return send(url, L"GET", "", headers, retries);
-}
-
-http_client::response http_client::post(const std::wstring& url, const std::string& body, const header_map& headers, unsigned retries)
+namespace
 {
-    return send(url, L"POST", body, headers, retries);
-}
-
-http_client::response http_client::send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers)
-{
-    response resp;
-    resp.status_code = status_unknown;
-
-    auto session = ::WinHttpOpen(L"azhttp", 
-                                 proxy_.empty() ? WINHTTP_ACCESS_TYPE_NO_PROXY : WINHTTP_ACCESS_TYPE_NAMED_PROXY,
-                                 proxy_.empty() ? WINHTTP_NO_PROXY_NAME : proxy_.c_str(), 
-                                 WINHTTP_NO_PROXY_BYPASS, 
-                                 0);
-    if (!session)
+    http_client::response send_with_retries(transport& backend, const std::wstring& url, const std::wstring& verb, const std::string& request_body,
+                                            const http_client::header_map& headers, const transport::options& opts, unsigned retries)
     {
-        throw win32_error("WinHttpOpen");
+        for (;;)
+        {
+            try
+            {
+                return backend.send(url, verb, request_body, headers, opts);
+            }
+            catch (const std::exception& exc)
+            {
+                // A cancelled copy of a hedged request has lost the race, trying again would only compete with the winner.
+                if (retries-- > 0 && !(opts.cancel && opts.cancel->cancelled()))
+                {
+                    LOG_WARNING << L"Exception " << exc << L". Retries left: " << retries;
+                    continue;
+                }
+                throw;
+            }
+        }
     }
 
-    DWORD options = WINHTTP_FLAG_SECURE_PROTOCOL_TLS1 | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_1 | WINHTTP_FLAG_SECURE_PROTOCOL_TLS1_2;
-    if (!::WinHttpSetOption(session, WINHTTP_OPTION_SECURE_PROTOCOLS, &options, sizeof(options)))
+    // Outcome of a hedged request. The first copy runs on the calling thread, the second one, if the first is late,
+    // on the thread pool. A copy that succeeds cancels the other one.
+    struct hedge_state
     {
-        throw win32_error("WinHttpSetOption");
-    }
-
-    const auto session_grd = scoped_cleanup([&session]() { ::WinHttpCloseHandle(session); });
+        hedge_state() :
+            first_done(false),
+            second_running(false),
+            second_answered(false)
+        {
+        }
 
-    URL_COMPONENTS components = { 0 };
-    components.dwStructSize = sizeof(components);
-    components.dwSchemeLength = 1;
-    components.dwHostNameLength = 1;
-    components.dwUrlPathLength = 1;
-    if (!::WinHttpCrackUrl(url.c_str(), 0, 0, &components))
+        boost::mutex mutex;
+        boost::condition_variable changed;
+        bool first_done;
+        bool second_running;
+        bool second_answered;
+        http_client::response second_resp;
+        transport::cancellation first_cancel;
+        transport::cancellation second_cancel;
+    };
+
+    // The second copy of a hedged request, owned by the callback that sends it.
+    struct hedge_copy
     {
-        throw win32_error("WinHttpCrackUrl");
-    }
-
-    const std::wstring host(components.lpszHostName, components.lpszHostName + components.dwHostNameLength);
-
-    if (!::WinHttpSetTimeouts(session, std::get<0>(timeouts_) * 1000,
-                                       std::get<1>(timeouts_) * 1000,
-                                       std::get<2>(timeouts_) * 1000,
-                                       std::get<3>(timeouts_) * 1000))
+        std::shared_ptr<transport> backend;
+        std::shared_ptr<hedge_state> state;
+        std::wstring url;
+        std::wstring verb;
+        std::string request_body;
+        http_client::header_map headers;
+        transport::options opts;
+        unsigned retries;
+    };
+
+    // Lives on the stack of send_hedged, which closes the timer before returning.
+    struct hedge_timer
     {
-        throw win32_error("WinHttpSetTimeouts");
-    }
+        hedge_policy* policy;
+        hedge_copy copy;
+        std::chrono::milliseconds delay;
+        PTP_CALLBACK_ENVIRON environment;
+    };
 
-    auto connection = ::WinHttpConnect(session, host.c_str(), components.nPort, 0);
-    if (!connection)
+    void CALLBACK copy_main(PTP_CALLBACK_INSTANCE, PVOID param)
     {
-        throw win32_error("WinHttpConnect");
-    }
+        std::unique_ptr<hedge_copy> copy(static_cast<hedge_copy*>(param));
+        auto& state = *copy->state;
 
-    const auto connection_grd = scoped_cleanup([&connection]() { ::WinHttpCloseHandle(connection); });
+        http_client::response resp;
+        bool succeeded = false;
+        try
+        {
+            resp = send_with_retries(*copy->backend, copy->url, copy->verb, copy->request_body, copy->headers, copy->opts, copy->retries);
+            succeeded = true;
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_DEBUG << L"Second request to " << copy->url << L" failed: " << exc;
+        }
 
-    const DWORD flags = (components.nScheme == INTERNET_SCHEME_HTTPS) ? WINHTTP_FLAG_SECURE : 0;
+        {
+            boost::lock_guard<boost::mutex> lock(state.mutex);
+            if (succeeded)
+            {
+                state.second_answered = true;
+                state.second_resp = std::move(resp);
+            }
+            state.second_running = false;
+        }
+        state.changed.notify_all();
 
-    auto request = ::WinHttpOpenRequest(connection, verb.c_str(), components.lpszUrlPath, nullptr, nullptr, WINHTTP_DEFAULT_ACCEPT_TYPES, flags);
-    if (!request)
-    {
-        throw win32_error("WinHttpOpenRequest");
+        if (succeeded)
+        {
+            state.first_cancel.cancel();
+        }
     }
 
-    options = WINHTTP_DISABLE_KEEP_ALIVE;
-    if (!::WinHttpSetOption(request, WINHTTP_OPTION_DISABLE_FEATURE, &options, sizeof(options)))
+    void CALLBACK timer_main(PTP_CALLBACK_INSTANCE, PVOID param, PTP_TIMER)
     {
-        throw win32_error("WinHttpSetOption");
-    }
+        const auto& timer = *static_cast<const hedge_timer*>(param);
+        auto& state = *timer.copy.state;
 
-    const auto request_grd = scoped_cleanup([&request]() { ::WinHttpCloseHandle(request); });
-
-    const auto request_headers_str = headers_to_string(headers);
-    if (!::WinHttpSendRequest(request, 
-                              request_headers_str.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : request_headers_str.c_str(),
-                              static_cast<DWORD>(request_headers_str.size()),
-                              request_body.empty() ? WINHTTP_NO_REQUEST_DATA : const_cast<char *>(request_body.data()),
-                              static_cast<DWORD>(request_body.size()),
-                              static_cast<DWORD>(request_body.size()),
-                              0))
-    {
-        const auto error = ::GetLastError();
-        if (error == ERROR_WINHTTP_CLIENT_AUTH_CERT_NEEDED)
+        try
         {
-            if (!::WinHttpSetOption(request, WINHTTP_OPTION_CLIENT_CERT_CONTEXT, WINHTTP_NO_CLIENT_CERT_CONTEXT, 0))
             {
-                return resp;
+                boost::lock_guard<boost::mutex> lock(state.mutex);
+                if (state.first_done || !timer.policy->try_acquire())
+                {
+                    return;
+                }
+                state.second_running = true;
             }
 
-            if (!::WinHttpSendRequest(request, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0))
+            LOG_DEBUG << L"No response from " << timer.copy.url << L" after " << timer.delay.count() << L" ms, sending a second request.";
+
+            std::unique_ptr<hedge_copy> copy(new hedge_copy(timer.copy));
+            if (!::TrySubmitThreadpoolCallback(&copy_main, copy.get(), timer.environment))
             {
-                throw win32_error("WinHttpSendRequest");
+                throw win32_error("TrySubmitThreadpoolCallback");
             }
+            copy.release();
         }
-        else
+        catch (const std::exception& exc)
         {
-            throw win32_error("WinHttpSendRequest");
+            LOG_WARNING << L"Could not send the second request: " << exc;
+
+            {
+                boost::lock_guard<boost::mutex> lock(state.mutex);
+                state.second_running = false;
+            }
+            state.changed.notify_all();
         }
     }
 
-    if (!::WinHttpReceiveResponse(request, NULL))
+    HMODULE this_module()
     {
-        throw win32_error("WinHttpReceiveResponse");
+        HMODULE module = nullptr;
+        if (!::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, reinterpret_cast<LPCWSTR>(&this_module), &module))
+        {
+            throw win32_error("GetModuleHandleExW");
+        }
+        return module;
     }
+}
 
-    DWORD status_code = 0;
-    DWORD header_size = sizeof(status_code);
+const DWORD http_client::status_unknown = transport::status_unknown;
 
-    if (!::WinHttpQueryHeaders(request, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status_code, &header_size, WINHTTP_NO_HEADER_INDEX))
-    {
-        throw win32_error("WinHttpQueryHeaders");
-    }
+http_client::http_client() :
+    http_client(std::unique_ptr<transport>(new winhttp_transport()))
+{
+}
 
-    header_map response_headers;
+http_client::http_client(std::unique_ptr<transport> backend) :
+    timeouts_(30, 30, 30, 30),
+    transport_(std::move(backend))
+{
+}
 
-    // Allocate memory for the buffer.
-    if (!::WinHttpQueryHeaders(request, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, nullptr, &header_size, WINHTTP_NO_HEADER_INDEX) &&
-        ::GetLastError() == ERROR_INSUFFICIENT_BUFFER)
-    {
-        std::wstring headers_str(header_size / sizeof(wchar_t), 0);
+void http_client::timeouts(int resolve, int connect, int send, int receive)
+{
+    timeouts_ = std::make_tuple(resolve, connect, send, receive);
+}
 
-        if (!::WinHttpQueryHeaders(request, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, &headers_str[0], &header_size, WINHTTP_NO_HEADER_INDEX))
-        {
-            throw win32_error("WinHttpQueryHeaders");
-        }
+std::tuple<int, int, int, int> http_client::timeouts() const
+{
+    return timeouts_;
+}
 
-        response_headers = string_to_headers(headers_str);
-    }
+void http_client::proxy(const std::wstring& proxy)
+{
+    proxy_ = proxy;
+}
+
+std::wstring http_client::proxy() const
+{
+    return proxy_;
+}
 
-    std::string response_body;
-    for (;;)
+bool http_client::retry_after(const response& resp, std::chrono::milliseconds& delay)
+{
+    const auto it = resp.headers.find(L"Retry-After");
+    if (it == resp.headers.end())
     {
-        DWORD available = 0;
-        if (!::WinHttpQueryDataAvailable(request, &available))
-        {
-            throw win32_error("WinHttpQueryDataAvailable");
-        }
+        return false;
+    }
 
-        if (!available)
-        {
-            break;
-        }
+    try
+    {
+        delay = std::chrono::seconds(std::stoul(it->second));
+        return true;
+    }
+    catch (const std::exception&)
+    {
+        // HTTP-date form, not used by the services we talk to.
+        return false;
+    }
+}
 
-        std::string chunk(available, 0);
+http_client::response http_client::get(const std::wstring& url, const header_map& headers, unsigned retries, transport::body_sink* sink)
+{
+    return send(url, L"GET", "", headers, retries, sink);
+}
 
-        DWORD downloaded = 0;
-        if (!::WinHttpReadData(request, &chunk[0], available, &downloaded))
-        {
-            // Sometimes WinHttpReadData returns FALSE when no data is available
-            // In such case last error is ERROR_SUCCESS. This is not an error condition.
-            const auto error = ::GetLastError();
-            if (error != ERROR_SUCCESS)
-            {
-                throw win32_error("WinHttpReadData");
-            }
-        }
+http_client::response http_client::post(const std::wstring& url, const std::string& body, const header_map& headers, unsigned retries, transport::body_sink* sink)
+{
+    return send(url, L"POST", body, headers, retries, sink);
+}
 
-        chunk.resize(downloaded);
+http_client::response http_client::get_hedged(const std::wstring& url, const header_map& headers, unsigned retries, transport::body_sink* sink)
+{
+    return send_hedged(url, L"GET", "", headers, retries, sink);
+}
 
-        response_body += chunk;
-    }
+http_client::response http_client::post_hedged(const std::wstring& url, const std::string& body, const header_map& headers, unsigned retries, transport::body_sink* sink)
+{
+    return send_hedged(url, L"POST", body, headers, retries, sink);
+}
 
-    using std::swap;
-    swap(resp.status_code, status_code);
-    swap(resp.headers, response_headers);
-    swap(resp.body, response_body);
+transport::options http_client::options(transport::body_sink* sink) const
+{
+    transport::options opts;
+    opts.timeouts = timeouts_;
+    opts.proxy = proxy_;
+    opts.sink = sink;
+    return opts;
+}
 
-    return resp;
+http_client::response http_client::send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, unsigned retries, transport::body_sink* sink)
+{
+    return send_with_retries(*transport_, url, verb, request_body, headers, options(sink), retries);
 }
 
-http_client::response http_client::send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, unsigned retries)
+http_client::response http_client::send_hedged(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, unsigned retries, transport::body_sink* sink)
 {
-    for (;;)
+    const auto delay = hedge_.delay(url);
+    const auto started = std::chrono::steady_clock::now();
+    const auto state = std::make_shared<hedge_state>();
+
+    // Callbacks hold the DLL while they run, so a second copy that outlives this call is never unloaded under it.
+    TP_CALLBACK_ENVIRON environment;
+    ::InitializeThreadpoolEnvironment(&environment);
+    ::SetThreadpoolCallbackLibrary(&environment, this_module());
+    ::SetThreadpoolCallbackRunsLong(&environment);
+    const auto environment_grd = scoped_cleanup([&environment]() { ::DestroyThreadpoolEnvironment(&environment); });
+
+    // The second copy collects its body, which is passed on to the sink only if it wins. It goes over a connection
+    // of its own, on the same one it would wait behind whatever is holding up the first copy.
+    hedge_timer timer = { &hedge_, { transport_, state, url, verb, request_body, headers, options(nullptr), retries }, delay, &environment };
+    timer.copy.opts.separate_connection = true;
+    timer.copy.opts.cancel = &state->second_cancel;
+
+    auto opts = options(sink);
+    opts.cancel = &state->first_cancel;
+
+    response resp;
+    std::exception_ptr error;
     {
+        const auto tp_timer = ::CreateThreadpoolTimer(&timer_main, &timer, &environment);
+        if (!tp_timer)
+        {
+            throw win32_error("CreateThreadpoolTimer");
+        }
+
+        // Only waits for the timer callback itself, not for a second copy it started.
+        const auto timer_grd = scoped_cleanup([tp_timer]()
+            {
+                ::SetThreadpoolTimer(tp_timer, nullptr, 0, 0);
+                ::WaitForThreadpoolTimerCallbacks(tp_timer, TRUE);
+                ::CloseThreadpoolTimer(tp_timer);
+            });
+
+        // Relative due times are negative, in 100 ns units.
+        ULARGE_INTEGER due;
+        due.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(delay.count()) * 10000);
+        FILETIME due_time = { due.LowPart, due.HighPart };
+        ::SetThreadpoolTimer(tp_timer, &due_time, 0, 0);
+
         try
         {
-            return send(url, verb, request_body, headers);
+            resp = send_with_retries(*transport_, url, verb, request_body, headers, opts, retries);
         }
-        catch (const std::exception& exc)
+        catch (const std::exception&)
         {
-            if (retries-- > 0)
-            {
-                std::wclog << L"Exception " << exc << L". Retries left: " << retries << std::endl;
-                continue;
-            }
-            throw;
+            error = std::current_exception();
         }
-    }
-}
 
-http_client::header_map http_client::string_to_headers(const std::wstring& str) const
-{
-    std::deque<std::wstring> header_kvps;
-    boost::iter_split(header_kvps, str, boost::first_finder(L"\r\n"));
+        boost::lock_guard<boost::mutex> lock(state->mutex);
+        state->first_done = true;
+    }
 
-    if (!header_kvps.empty())
+    if (!error)
     {
-        // 1st line is http status, skip it.
-        header_kvps.pop_front();
+        state->second_cancel.cancel();
     }
-
-    header_map headers;
-    for (const auto& header_kvp : header_kvps)
+    else
     {
-        auto delim_pos = header_kvp.find(L':');
-        if (delim_pos == header_kvp.npos)
+        // The first copy failed or was cancelled by a second copy that succeeded.
+        boost::unique_lock<boost::mutex> lock(state->mutex);
+        state->changed.wait(lock, [&]() { return !state->second_running; });
+        if (!state->second_answered)
         {
-            continue;
+            std::rethrow_exception(error);
         }
 
-        const auto key = header_kvp.substr(0, delim_pos++);
-        while ((delim_pos < header_kvp.size()) && boost::is_any_of(L" \t")(header_kvp[delim_pos]))
+        resp = std::move(state->second_resp);
+        lock.unlock();
+
+        if (sink && sink->begin(resp))
         {
-            ++delim_pos;
+            sink->write(resp.body.data(), resp.body.size());
+            resp.body.clear();
         }
-        const auto value = header_kvp.substr(delim_pos);
-        headers.insert(std::make_pair(key, value));
     }
-    return headers;
-}
 
-std::wstring http_client::headers_to_string(const header_map& headers) const
-{
-    std::vector<std::wstring> header_kvps;
-
-    std::transform(std::begin(headers), std::end(headers),
-        std::back_inserter(header_kvps),
-        [](const std::pair<std::wstring, std::wstring>& kvp)
-        {
-            return kvp.first + L": " + kvp.second;
-        });
-
-    return boost::join(header_kvps, L"\r\n");
+    // A hedged request took at least this long without the hedge, which keeps the percentile honest.
+    hedge_.record(url, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started));
+    return resp;
 }
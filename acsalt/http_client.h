@@ -1,12 +1,15 @@
 #pragma once
 
-#include "iless.h"
+#include "hedge_policy.h"
+#include "transport.h"
 
 class http_client : private boost::noncopyable
 {
 public:
     http_client();
 
+    explicit http_client(std::unique_ptr<transport> backend);
+
     void timeouts(int resolve, int connect, int send, int receive);
 
     std::tuple<int, int, int, int> timeouts() const;
@@ -15,30 +18,36 @@ public:
 
     std::wstring proxy() const;
 
-    typedef std::map<std::wstring, std::wstring, iless<std::wstring>> header_map;
+    typedef transport::header_map header_map;
 
-    struct response
-    {
-        DWORD status_code;
-        header_map headers;
-        std::string body;
-    };
+    typedef transport::response response;
 
     static const DWORD status_unknown;
 
-    response get(const std::wstring& url, const header_map& headers = header_map(), unsigned retries = 0);
+    // Parses a Retry-After header given in delta-seconds. Returns false if there is none.
+    static bool retry_after(const response& resp, std::chrono::milliseconds& delay);
+
+    response get(const std::wstring& url, const header_map& headers = header_map(), unsigned retries = 0, transport::body_sink* sink = nullptr);
+
+    response post(const std::wstring& url, const std::string& body, const header_map& headers = header_map(), unsigned retries = 0, transport::body_sink* sink = nullptr);
+
+    // For idempotent requests only: if the response is late, a second copy is sent and whichever answers first
+    // is returned. The first copy streams into the sink as usual, a second copy that wins is passed on once it is
+    // complete.
+    response get_hedged(const std::wstring& url, const header_map& headers = header_map(), unsigned retries = 0, transport::body_sink* sink = nullptr);
 
-    response post(const std::wstring& url, const std::string& body, const header_map& headers = header_map(), unsigned retries = 0);
+    response post_hedged(const std::wstring& url, const std::string& body, const header_map& headers = header_map(), unsigned retries = 0, transport::body_sink* sink = nullptr);
 
 private:
     std::tuple<int, int, int, int> timeouts_;
     std::wstring proxy_;
+    // Shared with the second copies of hedged requests, which may finish after send_hedged has returned.
+    std::shared_ptr<transport> transport_;
+    hedge_policy hedge_;
 
-    response send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers);
+    transport::options options(transport::body_sink* sink) const;
 
-    response send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, unsigned retries);
+    response send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, unsigned retries, transport::body_sink* sink);
 
-    header_map string_to_headers(const std::wstring& str) const;
-    
-    std::wstring headers_to_string(const header_map& headers) const;
+    response send_hedged(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, unsigned retries, transport::body_sink* sink);
 };
@@ -0,0 +1,105 @@
+#include "pch.h"
+#include "ipc_security.h"
+
+#include "scoped_cleanup.h"
+#include "win32_error.h"
+
+#include <sddl.h>
+
+namespace
+{
+    std::string current_user_sid()
+    {
+        HANDLE token = nullptr;
+        if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_QUERY, &token))
+        {
+            throw win32_error("OpenProcessToken");
+        }
+
+        const auto token_grd = scoped_cleanup([&token]() { ::CloseHandle(token); });
+
+        DWORD size = 0;
+        (void)::GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+        std::vector<BYTE> buffer(size, 0);
+        if (!::GetTokenInformation(token, TokenUser, buffer.data(), size, &size))
+        {
+            throw win32_error("GetTokenInformation");
+        }
+
+        LPSTR sid = nullptr;
+        if (!::ConvertSidToStringSidA(reinterpret_cast<TOKEN_USER*>(buffer.data())->User.Sid, &sid))
+        {
+            throw win32_error("ConvertSidToStringSidA");
+        }
+
+        const auto sid_grd = scoped_cleanup([sid]() { ::LocalFree(sid); });
+        return sid;
+    }
+
+    class user_security : boost::noncopyable
+    {
+    public:
+        user_security() :
+            sid_(current_user_sid()),
+            attributes_()
+        {
+            // Protected, so nothing is inherited from the parent, and passed on to the files of a directory.
+            const auto sddl = "D:P(A;OICI;GA;;;" + sid_ + ")";
+
+            PSECURITY_DESCRIPTOR descriptor = nullptr;
+            if (!::ConvertStringSecurityDescriptorToSecurityDescriptorA(sddl.c_str(), SDDL_REVISION_1, &descriptor, nullptr))
+            {
+                throw win32_error("ConvertStringSecurityDescriptorToSecurityDescriptorA");
+            }
+
+            attributes_.nLength = sizeof(attributes_);
+            attributes_.lpSecurityDescriptor = descriptor;
+            attributes_.bInheritHandle = FALSE;
+        }
+
+        ~user_security()
+        {
+            ::LocalFree(attributes_.lpSecurityDescriptor);
+        }
+
+        static user_security& instance()
+        {
+            static user_security security;
+            return security;
+        }
+
+        const std::string& sid() const
+        {
+            return sid_;
+        }
+
+        SECURITY_ATTRIBUTES* attributes()
+        {
+            return &attributes_;
+        }
+
+    private:
+        std::string sid_;
+        SECURITY_ATTRIBUTES attributes_;
+    };
+}
+
+namespace ipc_security
+{
+
+std::string object_name(const std::string& base)
+{
+    return base + "-" + user_security::instance().sid();
+}
+
+boost::interprocess::permissions owner_only()
+{
+    return boost::interprocess::permissions(owner_only_attributes());
+}
+
+SECURITY_ATTRIBUTES* owner_only_attributes()
+{
+    return user_security::instance().attributes();
+}
+
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// Names and access rights for the shared memory and mutexes the processes of one user share. Names carry the
+// user SID and new objects get a DACL that grants access to that user only, so processes of other users on the
+// same machine can neither squat the name nor read what is shared.
+namespace ipc_security
+{
+    // Returns `base` followed by the SID of the current user.
+    std::string object_name(const std::string& base);
+
+    // Full access for the current user, nobody else. Valid for the lifetime of the process.
+    boost::interprocess::permissions owner_only();
+
+    // The same for CreateDirectoryW and friends. Files created in such a directory inherit the restriction.
+    SECURITY_ATTRIBUTES* owner_only_attributes();
+}
@@ -0,0 +1,394 @@
+#include "pch.h"
+#include "logging.h"
+
+#include "encoder.h"
+
+namespace
+{
+    const std::size_t max_record_length = 512;
+    const std::uint32_t ring_size = 64;
+
+    // The writer wakes up this often, or earlier when a ring is half full.
+    const DWORD writer_poll_ms = 50;
+
+    // Idle polls before the writer exits, it is started again by the next record.
+    const unsigned writer_idle_polls = 20;
+
+    const DWORD flush_timeout_ms = 100;
+
+    struct slot
+    {
+        std::uint64_t sequence;
+        logging::level level;
+        FILETIME time;
+        std::uint32_t length;
+        wchar_t text[max_record_length];
+    };
+
+    // Single producer (the owning thread), single consumer (whoever holds the drain mutex).
+    struct ring
+    {
+        ring() :
+            thread_id(::GetCurrentThreadId()),
+            head(0),
+            tail(0)
+        {
+        }
+
+        const DWORD thread_id;
+        std::atomic<std::uint32_t> head;
+        std::atomic<std::uint32_t> tail;
+        slot slots[ring_size];
+    };
+
+    // Formats into a fixed array instead of a growing string, overflowing text is dropped.
+    class fixed_buffer : public std::wstreambuf
+    {
+    public:
+        fixed_buffer()
+        {
+            reset();
+        }
+
+        void reset()
+        {
+            setp(buffer_, buffer_ + max_record_length);
+        }
+
+        const wchar_t* data() const
+        {
+            return pbase();
+        }
+
+        std::size_t size() const
+        {
+            return static_cast<std::size_t>(pptr() - pbase());
+        }
+
+    protected:
+        int_type overflow(int_type c) override
+        {
+            return traits_type::not_eof(c);
+        }
+
+    private:
+        wchar_t buffer_[max_record_length];
+    };
+
+    struct formatter
+    {
+        formatter() :
+            stream(&buffer)
+        {
+        }
+
+        fixed_buffer buffer;
+        std::wostream stream;
+    };
+
+    std::wstring environment(const wchar_t* name)
+    {
+        const DWORD size = ::GetEnvironmentVariableW(name, nullptr, 0);
+        if (!size)
+        {
+            return std::wstring();
+        }
+
+        std::wstring value(size, 0);
+        value.resize(::GetEnvironmentVariableW(name, &value[0], size));
+        return value;
+    }
+
+    int read_threshold()
+    {
+        const auto value = environment(L"ACSALT_LOG");
+        if (boost::iequals(value, L"debug"))
+        {
+            return logging::debug;
+        }
+        if (boost::iequals(value, L"warning"))
+        {
+            return logging::warning;
+        }
+        if (boost::iequals(value, L"error"))
+        {
+            return logging::error;
+        }
+        if (boost::iequals(value, L"off"))
+        {
+            return logging::error + 1;
+        }
+        return logging::info;
+    }
+
+    struct state
+    {
+        state() :
+            threshold(read_threshold()),
+            key_value(boost::iequals(environment(L"ACSALT_LOG_FORMAT"), L"kv")),
+            sequence(0),
+            dropped(0),
+            writer_running(false),
+            wake(::CreateEventW(nullptr, FALSE, FALSE, nullptr))
+        {
+        }
+
+        const int threshold;
+        const bool key_value;
+        std::atomic<std::uint64_t> sequence;
+        std::atomic<std::uint64_t> dropped;
+        std::atomic<bool> writer_running;
+        HANDLE wake;
+
+        boost::mutex rings_mutex;
+        std::vector<std::shared_ptr<ring>> rings;
+
+        boost::timed_mutex drain_mutex;
+    };
+
+    state& global()
+    {
+        // Intentionally leaked, records can be made and flushed until the DLL is detached.
+        static state* s = new state();
+        return *s;
+    }
+
+    ring& local_ring()
+    {
+        thread_local std::shared_ptr<ring> r;
+        if (!r)
+        {
+            r = std::make_shared<ring>();
+
+            auto& g = global();
+            boost::lock_guard<boost::mutex> lock(g.rings_mutex);
+            g.rings.push_back(r);
+        }
+        return *r;
+    }
+
+    formatter& local_formatter()
+    {
+        thread_local formatter f;
+        return f;
+    }
+
+    const wchar_t* level_name(logging::level lvl)
+    {
+        switch (lvl)
+        {
+        case logging::debug:
+            return L"debug";
+        case logging::info:
+            return L"info";
+        case logging::warning:
+            return L"warning";
+        default:
+            return L"error";
+        }
+    }
+
+    struct pending
+    {
+        std::uint64_t sequence;
+        logging::level level;
+        FILETIME time;
+        DWORD thread_id;
+        std::wstring text;
+    };
+
+    void write(const pending& p, bool key_value)
+    {
+        if (!key_value)
+        {
+            std::wclog << p.text << L'\n';
+            return;
+        }
+
+        SYSTEMTIME st;
+        ::FileTimeToSystemTime(&p.time, &st);
+
+        wchar_t time[32];
+        std::swprintf(time, sizeof(time) / sizeof(time[0]), L"%04u-%02u-%02uT%02u:%02u:%02u.%03uZ",
+                      st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+
+        std::wclog << L"time=" << time << L" level=" << level_name(p.level) << L" tid=" << p.thread_id << L" msg=" << p.text << L'\n';
+    }
+
+    // Callers must hold the drain mutex. Returns the number of records written.
+    std::size_t drain_locked()
+    {
+        auto& g = global();
+
+        std::vector<std::shared_ptr<ring>> rings;
+        {
+            boost::lock_guard<boost::mutex> lock(g.rings_mutex);
+            rings = g.rings;
+        }
+
+        std::vector<pending> records;
+        for (const auto& r : rings)
+        {
+            const auto tail = r->tail.load(std::memory_order_relaxed);
+            const auto head = r->head.load(std::memory_order_acquire);
+            for (auto i = tail; i != head; ++i)
+            {
+                const auto& s = r->slots[i % ring_size];
+                pending p = { s.sequence, s.level, s.time, r->thread_id, std::wstring(s.text, s.length) };
+                records.push_back(std::move(p));
+            }
+            r->tail.store(head, std::memory_order_release);
+        }
+
+        {
+            // Rings of exited threads are only referenced from here and by the copy above.
+            boost::lock_guard<boost::mutex> lock(g.rings_mutex);
+            g.rings.erase(std::remove_if(g.rings.begin(), g.rings.end(), [](const std::shared_ptr<ring>& r)
+                {
+                    return r.use_count() == 2 && r->tail.load() == r->head.load();
+                }), g.rings.end());
+        }
+
+        const auto dropped = g.dropped.exchange(0);
+        if (records.empty() && !dropped)
+        {
+            return 0;
+        }
+
+        std::sort(records.begin(), records.end(), [](const pending& a, const pending& b) { return a.sequence < b.sequence; });
+        for (const auto& p : records)
+        {
+            write(p, g.key_value);
+        }
+
+        if (dropped)
+        {
+            std::wclog << dropped << L" log records were dropped." << L'\n';
+        }
+
+        std::wclog.flush();
+        return records.size();
+    }
+
+    DWORD WINAPI writer_main(LPVOID module)
+    {
+        auto& g = global();
+
+        for (unsigned idle = 0; idle < writer_idle_polls;)
+        {
+            ::WaitForSingleObject(g.wake, writer_poll_ms);
+
+            boost::lock_guard<boost::timed_mutex> lock(g.drain_mutex);
+            idle = drain_locked() ? 0 : idle + 1;
+        }
+
+        // Records made after this point start a new writer, the ones made just before are picked up here.
+        g.writer_running = false;
+        {
+            boost::lock_guard<boost::timed_mutex> lock(g.drain_mutex);
+            drain_locked();
+        }
+
+        // The writer holds a reference to the DLL, so it is never unloaded under the running thread.
+        ::FreeLibraryAndExitThread(static_cast<HMODULE>(module), 0);
+    }
+
+    void ensure_writer()
+    {
+        auto& g = global();
+        if (g.writer_running.exchange(true))
+        {
+            return;
+        }
+
+        HMODULE module = nullptr;
+        if (!::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(&writer_main), &module))
+        {
+            g.writer_running = false;
+            return;
+        }
+
+        HANDLE thread = ::CreateThread(nullptr, 0, &writer_main, module, 0, nullptr);
+        if (!thread)
+        {
+            ::FreeLibrary(module);
+            g.writer_running = false;
+            return;
+        }
+
+        ::CloseHandle(thread);
+    }
+}
+
+namespace logging
+{
+
+bool enabled(level lvl)
+{
+    return lvl >= global().threshold;
+}
+
+record::record(level lvl) :
+    level_(lvl)
+{
+    auto& f = local_formatter();
+    f.buffer.reset();
+    f.stream.clear();
+}
+
+record::~record()
+{
+    auto& g = global();
+    auto& r = local_ring();
+    const auto& f = local_formatter();
+
+    const auto head = r.head.load(std::memory_order_relaxed);
+    if (head - r.tail.load(std::memory_order_acquire) == ring_size)
+    {
+        // The writer is behind, drain on this thread rather than waiting for it.
+        flush();
+        if (head - r.tail.load(std::memory_order_acquire) == ring_size)
+        {
+            ++g.dropped;
+            return;
+        }
+    }
+
+    auto& s = r.slots[head % ring_size];
+    s.sequence = g.sequence++;
+    s.level = level_;
+    ::GetSystemTimeAsFileTime(&s.time);
+    s.length = static_cast<std::uint32_t>(f.buffer.size());
+    std::memcpy(s.text, f.buffer.data(), s.length * sizeof(wchar_t));
+    r.head.store(head + 1, std::memory_order_release);
+
+    if (head + 1 - r.tail.load(std::memory_order_relaxed) >= ring_size / 2 || level_ >= error)
+    {
+        ::SetEvent(g.wake);
+    }
+
+    ensure_writer();
+}
+
+std::wostream& record::stream()
+{
+    return local_formatter().stream;
+}
+
+std::wostream& operator<<(std::wostream& os, const field_t<std::string>& f)
+{
+    return os << L' ' << f.key << L'=' << encoder::to_wstring(f.value);
+}
+
+void flush()
+{
+    auto& g = global();
+
+    boost::unique_lock<boost::timed_mutex> lock(g.drain_mutex, boost::defer_lock);
+    if (lock.try_lock_for(boost::chrono::milliseconds(flush_timeout_ms)))
+    {
+        drain_locked();
+    }
+}
+
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// Asynchronous logging. A record is formatted into a fixed per-thread buffer and pushed to a lock-free per-thread
+// ring, a background writer drains the rings into std::wclog in the order the records were made. Statements below
+// ACSALT_LOG_LEVEL are compiled out, the runtime threshold comes from the ACSALT_LOG environment variable
+// (debug, info, warning, error or off, info by default). Set ACSALT_LOG_FORMAT=kv for key/value records.
+
+#define ACSALT_LOG_LEVEL_DEBUG 0
+#define ACSALT_LOG_LEVEL_INFO 1
+#define ACSALT_LOG_LEVEL_WARNING 2
+#define ACSALT_LOG_LEVEL_ERROR 3
+
+#ifndef ACSALT_LOG_LEVEL
+#define ACSALT_LOG_LEVEL ACSALT_LOG_LEVEL_DEBUG
+#endif
+
+#define ACSALT_LOG(lvl) \
+    if (ACSALT_LOG_LEVEL_##lvl < ACSALT_LOG_LEVEL || !logging::enabled(logging::level(ACSALT_LOG_LEVEL_##lvl))) {} else logging::record(logging::level(ACSALT_LOG_LEVEL_##lvl)).stream()
+
+#define LOG_DEBUG ACSALT_LOG(DEBUG)
+#define LOG_INFO ACSALT_LOG(INFO)
+#define LOG_WARNING ACSALT_LOG(WARNING)
+#define LOG_ERROR ACSALT_LOG(ERROR)
+
+namespace logging
+{
+    enum level
+    {
+        debug = ACSALT_LOG_LEVEL_DEBUG,
+        info = ACSALT_LOG_LEVEL_INFO,
+        warning = ACSALT_LOG_LEVEL_WARNING,
+        error = ACSALT_LOG_LEVEL_ERROR
+    };
+
+    bool enabled(level lvl);
+
+    // One log statement. The text is committed to the ring when the record goes out of scope, records longer
+    // than the per-thread buffer are truncated.
+    class record : boost::noncopyable
+    {
+    public:
+        explicit record(level lvl);
+
+        ~record();
+
+        std::wostream& stream();
+
+    private:
+        level level_;
+    };
+
+    template <typename T>
+    struct field_t
+    {
+        const wchar_t* key;
+        const T& value;
+    };
+
+    // Appends ` key=value` to the record.
+    template <typename T>
+    field_t<T> field(const wchar_t* key, const T& value)
+    {
+        return field_t<T>{ key, value };
+    }
+
+    template <typename T>
+    std::wostream& operator<<(std::wostream& os, const field_t<T>& f)
+    {
+        return os << L' ' << f.key << L'=' << f.value;
+    }
+
+    std::wostream& operator<<(std::wostream& os, const field_t<std::string>& f);
+
+    // Writes out pending records on the calling thread. Gives up after a short wait if the writer is stuck,
+    // so it is safe to call while the process is shutting down.
+    void flush();
+}
@@ -0,0 +1,125 @@
+#include "pch.h"
+#include "login_gate.h"
+#include "ipc_security.h"
+#include "logging.h"
+
+namespace
+{
+    const std::size_t max_flights = 16;
+
+    // Waiters wake up this often to check whether the process that is logging in is still alive.
+    const boost::posix_time::seconds owner_check_interval(1);
+
+    bool process_alive(DWORD pid)
+    {
+        HANDLE process = ::OpenProcess(SYNCHRONIZE, FALSE, pid);
+        if (!process)
+        {
+            return ::GetLastError() == ERROR_ACCESS_DENIED;
+        }
+
+        const bool alive = ::WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+        ::CloseHandle(process);
+        return alive;
+    }
+}
+
+struct login_gate::state
+{
+    struct flight
+    {
+        std::uint64_t key;
+        DWORD pid;
+    };
+
+    state()
+    {
+        std::memset(flights, 0, sizeof(flights));
+    }
+
+    flight* find(std::uint64_t key, DWORD pid)
+    {
+        for (auto& f : flights)
+        {
+            if (f.key == key && (pid == 0 || f.pid == pid))
+            {
+                return &f;
+            }
+        }
+        return nullptr;
+    }
+
+    boost::interprocess::interprocess_mutex mutex;
+    boost::interprocess::interprocess_condition changed;
+    flight flights[max_flights];
+};
+
+login_gate& login_gate::instance()
+{
+    static login_gate gate;
+    return gate;
+}
+
+login_gate::login_gate() :
+    shm_(boost::interprocess::open_or_create, ipc_security::object_name("acsalt-login").c_str(), 64 * 1024, nullptr, ipc_security::owner_only()),
+    state_(shm_.find_or_construct<state>("state")())
+{
+}
+
+bool login_gate::begin(std::uint64_t key, const std::function<bool(const token_cache::entry&)>& satisfied)
+{
+    boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+
+    for (;;)
+    {
+        token_cache::entry e;
+        if (token_cache::instance().read(key, e) && satisfied(e))
+        {
+            return false;
+        }
+
+        auto flight = state_->find(key, 0);
+        if (flight && process_alive(flight->pid))
+        {
+            LOG_INFO << L"Another process is logging in, waiting for its token...";
+            state_->changed.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + owner_check_interval);
+            continue;
+        }
+
+        // Take over a flight whose owner died, or claim a free one. If all of them are taken, log in uncoordinated.
+        if (!flight)
+        {
+            flight = state_->find(0, 0);
+        }
+
+        if (flight)
+        {
+            flight->key = key;
+            flight->pid = ::GetCurrentProcessId();
+        }
+
+        return true;
+    }
+}
+
+void login_gate::end(std::uint64_t key)
+{
+    {
+        boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+
+        auto flight = state_->find(key, ::GetCurrentProcessId());
+        if (flight)
+        {
+            flight->key = 0;
+            flight->pid = 0;
+        }
+    }
+
+    state_->changed.notify_all();
+}
+
+void login_gate::exclusive(const std::function<void()>& fn)
+{
+    boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock(state_->mutex);
+    fn();
+}
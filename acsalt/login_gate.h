@@ -0,0 +1,29 @@
+#pragma once
+
+#include "token_cache.h"
+
+// Cross-process single-flight for logins. When many processes find the token expired at the same time, one of
+// them logs in while the others wait and then pick the new token up from the token cache.
+class login_gate : boost::noncopyable
+{
+public:
+    // Opens or creates the shared segment on first use.
+    static login_gate& instance();
+
+    // Blocks while another process logs in with the same credentials. Returns false as soon as the token cache
+    // holds a token `satisfied` accepts, true if the caller has to log in itself and call `end` afterwards.
+    bool begin(std::uint64_t key, const std::function<bool(const token_cache::entry&)>& satisfied);
+
+    void end(std::uint64_t key);
+
+    // Runs a short critical section, like a token file update, exclusively across processes.
+    void exclusive(const std::function<void()>& fn);
+
+private:
+    login_gate();
+
+    struct state;
+
+    boost::interprocess::managed_windows_shared_memory shm_;
+    state* state_;
+};
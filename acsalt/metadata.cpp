@@ -0,0 +1,44 @@
+#include "pch.h"
+#include "metadata.h"
+
+#include "encoder.h"
+
+metadata metadata::parse(const std::string& blob)
+{
+    const auto jv = boost::json::parse(blob);
+
+    metadata meta;
+
+    // Lets the client run against a sovereign cloud or a local stand-in for the login service.
+    const auto authority = jv.as_object().if_contains("authority");
+    meta.authority = authority ? encoder::to_wstring(boost::json::value_to<std::string>(*authority)) : L"https://login.microsoftonline.com";
+    meta.tenant = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("tenant")));
+    meta.client_id = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("client_id")));
+    meta.secret = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("secret")));
+    // A single endpoint or a list of regions to fail over between.
+    const auto& endpoint = jv.at("endpoint");
+    if (endpoint.is_array())
+    {
+        meta.endpoints = boost::json::value_to<std::vector<std::string>>(endpoint);
+    }
+    else
+    {
+        meta.endpoints.push_back(boost::json::value_to<std::string>(endpoint));
+    }
+
+    if (meta.endpoints.empty())
+    {
+        throw std::invalid_argument("no signing endpoint");
+    }
+    meta.account = boost::json::value_to<std::string>(jv.at("account"));
+    meta.profile = boost::json::value_to<std::string>(jv.at("profile"));
+    meta.correlation_id = boost::json::value_to<std::string>(jv.at("correlation_id"));
+
+    const auto broker = jv.as_object().if_contains("broker");
+    meta.broker = broker && broker->as_bool();
+
+    const auto cache = jv.as_object().if_contains("cache");
+    meta.cache = cache && cache->as_bool();
+
+    return meta;
+}
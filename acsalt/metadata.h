@@ -0,0 +1,21 @@
+#pragma once
+
+// Signing parameters passed through the signtool /dmdf metadata file.
+struct metadata
+{
+    std::wstring authority;
+    std::wstring tenant;
+    std::wstring client_id;
+    std::wstring secret;
+    // Equivalent regions, at least one. The first one keys caches, see signature_cache.
+    std::vector<std::string> endpoints;
+    std::string account;
+    std::string profile;
+    std::string correlation_id;
+    bool broker;
+
+    // Reuse signatures of digests signed before, see signature_cache.
+    bool cache;
+
+    static metadata parse(const std::string& blob);
+};
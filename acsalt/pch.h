@@ -6,6 +6,9 @@
 
 #pragma comment(lib, "crypt32")
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <string>
@@ -14,8 +17,14 @@
 #pragma warning(push)
 #pragma warning(disable: 4459)
 #include "boost/algorithm/string.hpp"
+#include "boost/container/small_vector.hpp"
 #include "boost/interprocess/managed_windows_shared_memory.hpp"
+#include "boost/interprocess/mapped_region.hpp"
+#include "boost/interprocess/windows_shared_memory.hpp"
+#include "boost/interprocess/sync/interprocess_condition.hpp"
+#include "boost/interprocess/sync/interprocess_mutex.hpp"
 #include "boost/interprocess/sync/named_mutex.hpp"
+#include "boost/interprocess/sync/scoped_lock.hpp"
 #include "boost/json.hpp"
 #include "boost/noncopyable.hpp"
 #include "boost/thread.hpp"
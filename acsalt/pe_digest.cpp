@@ -0,0 +1,314 @@
+#include "pch.h"
+#include "pe_digest.h"
+
+#include "file.h"
+#include "scoped_cleanup.h"
+#include "win32_error.h"
+
+#include <bcrypt.h>
+
+#pragma comment(lib, "bcrypt")
+
+namespace
+{
+    // BCryptHashData takes the length as ULONG, large sections are fed in pieces.
+    const std::size_t max_update = 1 << 30;
+
+    const std::size_t signature_alignment = 8;
+
+    void check(NTSTATUS status, const char* what)
+    {
+        if (!BCRYPT_SUCCESS(status))
+        {
+            throw std::system_error(HRESULT_FROM_NT(status), std::system_category(), what);
+        }
+    }
+
+    // CNG picks the SHA extensions or the vector code for the running CPU itself, providers are opened once
+    // per process and shared by all threads.
+    class algorithm : boost::noncopyable
+    {
+    public:
+        explicit algorithm(LPCWSTR id) :
+            handle_(nullptr),
+            hash_size_(0)
+        {
+            check(::BCryptOpenAlgorithmProvider(&handle_, id, nullptr, 0), "BCryptOpenAlgorithmProvider");
+
+            ULONG size = 0;
+            check(::BCryptGetProperty(handle_, BCRYPT_HASH_LENGTH, reinterpret_cast<PUCHAR>(&hash_size_), sizeof(hash_size_), &size, 0), "BCryptGetProperty");
+        }
+
+        ~algorithm()
+        {
+            ::BCryptCloseAlgorithmProvider(handle_, 0);
+        }
+
+        static const algorithm& get(ALG_ID alg)
+        {
+            static const algorithm sha256(BCRYPT_SHA256_ALGORITHM);
+            static const algorithm sha384(BCRYPT_SHA384_ALGORITHM);
+            static const algorithm sha512(BCRYPT_SHA512_ALGORITHM);
+
+            switch (alg)
+            {
+            case CALG_SHA_256:
+                return sha256;
+            case CALG_SHA_384:
+                return sha384;
+            case CALG_SHA_512:
+                return sha512;
+            default:
+                throw std::invalid_argument("invalid alg_id");
+            }
+        }
+
+        BCRYPT_ALG_HANDLE handle() const
+        {
+            return handle_;
+        }
+
+        DWORD hash_size() const
+        {
+            return hash_size_;
+        }
+
+    private:
+        BCRYPT_ALG_HANDLE handle_;
+        DWORD hash_size_;
+    };
+
+    class hasher : boost::noncopyable
+    {
+    public:
+        explicit hasher(const algorithm& alg) :
+            alg_(alg),
+            handle_(nullptr)
+        {
+            check(::BCryptCreateHash(alg.handle(), &handle_, nullptr, 0, nullptr, 0, 0), "BCryptCreateHash");
+        }
+
+        ~hasher()
+        {
+            ::BCryptDestroyHash(handle_);
+        }
+
+        void update(const BYTE* data, std::size_t size)
+        {
+            while (size)
+            {
+                const auto chunk = std::min(size, max_update);
+                check(::BCryptHashData(handle_, const_cast<PUCHAR>(data), static_cast<ULONG>(chunk), 0), "BCryptHashData");
+                data += chunk;
+                size -= chunk;
+            }
+        }
+
+        std::string finish()
+        {
+            std::string digest(alg_.hash_size(), 0);
+            check(::BCryptFinishHash(handle_, reinterpret_cast<PUCHAR>(&digest[0]), alg_.hash_size(), 0), "BCryptFinishHash");
+            return digest;
+        }
+
+    private:
+        const algorithm& alg_;
+        BCRYPT_HASH_HANDLE handle_;
+    };
+
+    class mapped_file : boost::noncopyable
+    {
+    public:
+        explicit mapped_file(const std::wstring& path) :
+            view_(nullptr),
+            size_(0)
+        {
+            file::handle file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (!file.valid())
+            {
+                throw win32_error("CreateFileW");
+            }
+
+            LARGE_INTEGER size;
+            if (!::GetFileSizeEx(file, &size))
+            {
+                throw win32_error("GetFileSizeEx");
+            }
+
+            if (!size.QuadPart || static_cast<ULONGLONG>(size.QuadPart) > std::numeric_limits<std::size_t>::max())
+            {
+                throw std::invalid_argument("file is empty or too large to map");
+            }
+
+            HANDLE mapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mapping)
+            {
+                throw win32_error("CreateFileMappingW");
+            }
+
+            // The view keeps the mapping alive.
+            const auto mapping_grd = scoped_cleanup([mapping]() { ::CloseHandle(mapping); });
+
+            view_ = static_cast<const BYTE*>(::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            if (!view_)
+            {
+                throw win32_error("MapViewOfFile");
+            }
+
+            size_ = static_cast<std::size_t>(size.QuadPart);
+        }
+
+        ~mapped_file()
+        {
+            ::UnmapViewOfFile(view_);
+        }
+
+        const BYTE* data() const
+        {
+            return view_;
+        }
+
+        std::size_t size() const
+        {
+            return size_;
+        }
+
+    private:
+        const BYTE* view_;
+        std::size_t size_;
+    };
+
+    [[noreturn]] void invalid_image()
+    {
+        throw std::invalid_argument("not a valid PE image");
+    }
+
+    template <typename T>
+    const T& at(const mapped_file& image, std::size_t offset)
+    {
+        if (offset > image.size() || image.size() - offset < sizeof(T))
+        {
+            invalid_image();
+        }
+        return *reinterpret_cast<const T*>(image.data() + offset);
+    }
+
+    void hash_range(hasher& h, const mapped_file& image, std::size_t begin, std::size_t end)
+    {
+        if (begin > end || end > image.size())
+        {
+            invalid_image();
+        }
+        h.update(image.data() + begin, end - begin);
+    }
+}
+
+namespace pe_digest
+{
+
+std::string compute(const std::wstring& path, ALG_ID alg)
+{
+    hasher h(algorithm::get(alg));
+    const mapped_file image(path);
+
+    const auto& dos = at<IMAGE_DOS_HEADER>(image, 0);
+    if (dos.e_magic != IMAGE_DOS_SIGNATURE)
+    {
+        invalid_image();
+    }
+
+    const std::size_t nt = static_cast<DWORD>(dos.e_lfanew);
+    if (at<DWORD>(image, nt) != IMAGE_NT_SIGNATURE)
+    {
+        invalid_image();
+    }
+
+    const auto& file_header = at<IMAGE_FILE_HEADER>(image, nt + sizeof(DWORD));
+    const std::size_t optional = nt + sizeof(DWORD) + sizeof(IMAGE_FILE_HEADER);
+
+    // The two optional header layouts agree up to the data directories, which start further out in PE32+.
+    std::size_t directories = 0;
+    DWORD directory_count = 0;
+    switch (at<WORD>(image, optional))
+    {
+    case IMAGE_NT_OPTIONAL_HDR32_MAGIC:
+        directories = optional + offsetof(IMAGE_OPTIONAL_HEADER32, DataDirectory);
+        directory_count = at<IMAGE_OPTIONAL_HEADER32>(image, optional).NumberOfRvaAndSizes;
+        break;
+    case IMAGE_NT_OPTIONAL_HDR64_MAGIC:
+        directories = optional + offsetof(IMAGE_OPTIONAL_HEADER64, DataDirectory);
+        directory_count = at<IMAGE_OPTIONAL_HEADER64>(image, optional).NumberOfRvaAndSizes;
+        break;
+    default:
+        invalid_image();
+    }
+
+    const std::size_t checksum = optional + offsetof(IMAGE_OPTIONAL_HEADER32, CheckSum);
+    const std::size_t headers_end = at<IMAGE_OPTIONAL_HEADER32>(image, optional).SizeOfHeaders;
+
+    // Headers, without the checksum and the certificate table entry, which change when the file is signed.
+    hash_range(h, image, 0, checksum);
+    std::size_t certificates = 0;
+    std::size_t certificates_size = 0;
+    if (directory_count > IMAGE_DIRECTORY_ENTRY_SECURITY)
+    {
+        const std::size_t entry = directories + IMAGE_DIRECTORY_ENTRY_SECURITY * sizeof(IMAGE_DATA_DIRECTORY);
+        const auto& security = at<IMAGE_DATA_DIRECTORY>(image, entry);
+
+        // Unlike the other entries, the certificate table is located by file offset.
+        certificates = security.VirtualAddress;
+        certificates_size = security.Size;
+
+        hash_range(h, image, checksum + sizeof(DWORD), entry);
+        hash_range(h, image, entry + sizeof(IMAGE_DATA_DIRECTORY), headers_end);
+    }
+    else
+    {
+        hash_range(h, image, checksum + sizeof(DWORD), headers_end);
+    }
+
+    // Sections in the order of their raw data, which is not necessarily the order of the section table.
+    const std::size_t section_table = optional + file_header.SizeOfOptionalHeader;
+    std::vector<const IMAGE_SECTION_HEADER*> sections;
+    sections.reserve(file_header.NumberOfSections);
+    for (WORD i = 0; i < file_header.NumberOfSections; ++i)
+    {
+        const auto& section = at<IMAGE_SECTION_HEADER>(image, section_table + i * sizeof(IMAGE_SECTION_HEADER));
+        if (section.SizeOfRawData)
+        {
+            sections.push_back(&section);
+        }
+    }
+
+    std::sort(sections.begin(), sections.end(), [](const IMAGE_SECTION_HEADER* a, const IMAGE_SECTION_HEADER* b)
+        {
+            return a->PointerToRawData < b->PointerToRawData;
+        });
+
+    std::size_t sections_end = headers_end;
+    for (const auto section : sections)
+    {
+        const std::size_t begin = section->PointerToRawData;
+        const std::size_t end = begin + section->SizeOfRawData;
+        hash_range(h, image, begin, end);
+        sections_end = std::max(sections_end, end);
+    }
+
+    // Data appended after the last section (installer payloads) is covered too, up to the existing signature.
+    const auto data_end = certificates_size ? certificates : image.size();
+    if (data_end > sections_end)
+    {
+        hash_range(h, image, sections_end, data_end);
+    }
+
+    // signtool pads unsigned files to the signature alignment before hashing them.
+    if (!certificates_size && image.size() % signature_alignment)
+    {
+        const BYTE padding[signature_alignment] = {};
+        h.update(padding, signature_alignment - image.size() % signature_alignment);
+    }
+
+    return h.finish();
+}
+
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Authenticode digest of PE images, computed the way signtool does before it calls the digest callback.
+namespace pe_digest
+{
+    // Returns the raw digest of the file at `path`. `alg` is CALG_SHA_256, CALG_SHA_384 or CALG_SHA_512.
+    // The file is mapped rather than read, the checksum, the certificate table entry and an existing signature
+    // are left out, and the sections are hashed in file order.
+    std::string compute(const std::wstring& path, ALG_ID alg);
+}
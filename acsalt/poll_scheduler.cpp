@@ -0,0 +1,84 @@
+#include "pch.h"
+#include "poll_scheduler.h"
+
+namespace
+{
+    const std::chrono::milliseconds min_delay(250);
+    const std::chrono::milliseconds max_delay(4000);
+    const std::chrono::milliseconds default_estimate(1000);
+    const std::chrono::seconds deadline(120);
+
+    // Weight of the latest completion time in the moving average.
+    const double ewma_alpha = 0.3;
+
+    boost::mutex estimates_mutex;
+    std::map<std::string, double> estimates_ms;
+
+    std::chrono::milliseconds clamp_delay(std::chrono::milliseconds delay)
+    {
+        return std::min(std::max(delay, min_delay), max_delay);
+    }
+
+    std::chrono::milliseconds estimate(const std::string& profile_key)
+    {
+        boost::lock_guard<boost::mutex> lock(estimates_mutex);
+        const auto it = estimates_ms.find(profile_key);
+        return it == estimates_ms.end() ? default_estimate : std::chrono::milliseconds(static_cast<long long>(it->second));
+    }
+}
+
+poll_scheduler::poll_scheduler(const std::string& profile_key) :
+    profile_key_(profile_key),
+    submitted_(std::chrono::steady_clock::now()),
+    in_progress_(submitted_),
+    backoff_(min_delay),
+    first_(true)
+{
+}
+
+std::chrono::milliseconds poll_scheduler::next_delay(const http_client::response& last)
+{
+    in_progress_ = std::chrono::steady_clock::now();
+
+    std::chrono::milliseconds delay(0);
+    if (http_client::retry_after(last, delay))
+    {
+        first_ = false;
+        return std::min(delay, max_delay);
+    }
+
+    if (first_)
+    {
+        first_ = false;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - submitted_);
+        return clamp_delay(estimate(profile_key_) - elapsed);
+    }
+
+    delay = backoff_;
+    backoff_ = clamp_delay(backoff_ * 2);
+    return delay;
+}
+
+bool poll_scheduler::expired() const
+{
+    return std::chrono::steady_clock::now() - submitted_ > deadline;
+}
+
+void poll_scheduler::completed()
+{
+    // Taking the end of the poll that saw it succeed, every sample would lie past the estimate that poll was aimed
+    // at and the estimate could only grow.
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed = std::chrono::duration<double, std::milli>(in_progress_ - submitted_ + (now - in_progress_) / 2).count();
+
+    boost::lock_guard<boost::mutex> lock(estimates_mutex);
+    auto it = estimates_ms.find(profile_key_);
+    if (it == estimates_ms.end())
+    {
+        estimates_ms[profile_key_] = elapsed;
+    }
+    else
+    {
+        it->second += ewma_alpha * (elapsed - it->second);
+    }
+}
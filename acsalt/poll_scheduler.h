@@ -0,0 +1,29 @@
+#pragma once
+
+#include "http_client.h"
+
+// Decides when to poll a signing operation. Honors Retry-After when the service sends it, otherwise aims the
+// first poll at the expected completion time of the profile and backs off exponentially after that.
+class poll_scheduler : boost::noncopyable
+{
+public:
+    // `profile_key` identifies the signing profile, completion times are tracked per profile.
+    explicit poll_scheduler(const std::string& profile_key);
+
+    // Delay before the next poll, `last` is the submit response or the previous poll response, both of which
+    // report the operation in progress.
+    std::chrono::milliseconds next_delay(const http_client::response& last);
+
+    bool expired() const;
+
+    // Feeds the completion time of the operation into the profile estimate. The operation finished somewhere
+    // between the last response in progress and now, the midpoint is taken.
+    void completed();
+
+private:
+    std::string profile_key_;
+    std::chrono::steady_clock::time_point submitted_;
+    std::chrono::steady_clock::time_point in_progress_;
+    std::chrono::milliseconds backoff_;
+    bool first_;
+};
@@ -0,0 +1,76 @@
+#include "pch.h"
+#include "request_builder.h"
+
+#include "encoder.h"
+
+namespace
+{
+    const std::wstring API_VERSION_QUERY = L"?api-version=2022-06-15-preview";
+
+    void append_json_string(const std::string& str, std::string& out)
+    {
+        static const char hex_digits[] = "0123456789abcdef";
+
+        out.push_back('"');
+        for (const auto c : str)
+        {
+            switch (c)
+            {
+            case '"':
+                out.append("\\\"");
+                break;
+            case '\\':
+                out.append("\\\\");
+                break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    out.append("\\u00");
+                    out.push_back(hex_digits[(c >> 4) & 0xf]);
+                    out.push_back(hex_digits[c & 0xf]);
+                }
+                else
+                {
+                    out.push_back(c);
+                }
+            }
+        }
+        out.push_back('"');
+    }
+}
+
+request_builder::request_builder(const std::string& endpoint, const std::string& account, const std::string& profile)
+{
+    // Percent-encode the narrow strings so multibyte characters come out byte by byte, as before.
+    std::string path = "/codesigningaccounts/";
+    encoder::url_encode(account, path);
+    path += "/certificateprofiles/";
+    encoder::url_encode(profile, path);
+
+    const auto base = encoder::to_wstring(boost::trim_right_copy_if(endpoint, boost::is_any_of(L"/")) + path);
+    sign_uri_ = base + L"/sign" + API_VERSION_QUERY;
+    status_prefix_ = base + L"/sign/";
+}
+
+const std::wstring& request_builder::sign_uri() const
+{
+    return sign_uri_;
+}
+
+void request_builder::status_uri(const std::string& opid, std::wstring& out) const
+{
+    out.assign(status_prefix_);
+    out.append(opid.begin(), opid.end());
+    out.append(API_VERSION_QUERY);
+}
+
+void request_builder::sign_body(const std::string& signature_alg, const std::string& digest, const std::string& correlation_id, std::string& out) const
+{
+    out.assign("{\"signatureAlgorithm\":");
+    append_json_string(signature_alg, out);
+    out.append(",\"digest\":");
+    append_json_string(digest, out);
+    out.append(",\"correlationId\":");
+    append_json_string(correlation_id, out);
+    out.push_back('}');
+}
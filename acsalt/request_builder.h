@@ -0,0 +1,20 @@
+#pragma once
+
+// Builds the signing service requests for one endpoint/account/profile. The URI prefixes are encoded once,
+// the per-request parts are written straight into caller-provided buffers that can be reused between requests.
+class request_builder : boost::noncopyable
+{
+public:
+    request_builder(const std::string& endpoint, const std::string& account, const std::string& profile);
+
+    const std::wstring& sign_uri() const;
+
+    void status_uri(const std::string& opid, std::wstring& out) const;
+
+    // Serializes the sign request body without building a JSON document first.
+    void sign_body(const std::string& signature_alg, const std::string& digest, const std::string& correlation_id, std::string& out) const;
+
+private:
+    std::wstring sign_uri_;
+    std::wstring status_prefix_;
+};
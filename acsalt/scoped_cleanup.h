@@ -18,6 +18,11 @@ namespace detail
             other.active_ = false;
         }
 
+        void dismiss()
+        {
+            active_ = false;
+        }
+
         ~scoped_cleanup_guard()
         {
             try
@@ -0,0 +1,252 @@
+#include "pch.h"
+#include "signature_cache.h"
+
+#include "encoder.h"
+#include "exception_strm.h"
+#include "file.h"
+#include "ipc_security.h"
+#include "logging.h"
+#include "trace.h"
+#include "win32_error.h"
+
+#include <aclapi.h>
+#include <bcrypt.h>
+
+namespace
+{
+    // Certificates of a profile are renewed daily and valid for a few days, a cached signature must still be
+    // timestamped while its certificate is valid.
+    const std::int64_t ttl_seconds = 24 * 60 * 60;
+
+    const std::size_t max_files = 4096;
+
+    // The poll deadline of a sign. A request that holds the mutex for longer is stuck, the others sign on their own.
+    const boost::posix_time::seconds coalesce_timeout(120);
+    const std::size_t max_entries = 1024;
+
+    std::int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // SHA-256 of the key parts in hex, used as file and mutex name.
+    std::string hash_key(const std::string& text)
+    {
+        BYTE hash[32];
+        DWORD size = sizeof(hash);
+        if (!::CryptHashCertificate2(BCRYPT_SHA256_ALGORITHM, 0, nullptr, reinterpret_cast<const BYTE*>(text.data()), static_cast<DWORD>(text.size()), hash, &size))
+        {
+            throw win32_error("CryptHashCertificate2");
+        }
+
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(size * 2);
+        for (DWORD i = 0; i < size; ++i)
+        {
+            hex += digits[hash[i] >> 4];
+            hex += digits[hash[i] & 0xf];
+        }
+        return hex;
+    }
+}
+
+signature_cache& signature_cache::instance()
+{
+    static signature_cache cache;
+    return cache;
+}
+
+signature_cache::signature_cache() :
+    directory_(4096, 0)
+{
+    const auto size = ::ExpandEnvironmentStringsW(L"%USERPROFILE%\\.acsalt-signatures\\", &directory_[0], static_cast<DWORD>(directory_.size()));
+    directory_.resize(size ? size - 1 : 0);
+
+    // Cached signatures are only as trustworthy as the directory, other users must not be able to plant them.
+    const auto attributes = ipc_security::owner_only_attributes();
+    if (!::CreateDirectoryW(directory_.c_str(), attributes) && ::GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        BOOL present = FALSE;
+        BOOL defaulted = FALSE;
+        PACL dacl = nullptr;
+        ::GetSecurityDescriptorDacl(attributes->lpSecurityDescriptor, &present, &dacl, &defaulted);
+
+        const auto error = ::SetNamedSecurityInfoW(&directory_[0], SE_FILE_OBJECT, DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+                                                   nullptr, nullptr, dacl, nullptr);
+        if (error != ERROR_SUCCESS)
+        {
+            LOG_WARNING << L"Failed to restrict access to " << directory_ << L": " << win32_error("SetNamedSecurityInfoW", error);
+        }
+    }
+}
+
+acs::signing_result signature_cache::lookup(unsigned alg_id, const std::string& digest, const std::string& endpoint, const std::string& account,
+                                            const std::string& profile, const sign_fn& sign)
+{
+    const auto key = hash_key(std::to_string(alg_id) + '\n' + endpoint + '\n' + account + '\n' + profile + '\n' + digest);
+
+    acs::signing_result result;
+    if (find(key, result))
+    {
+        LOG_INFO << L"Using cached signature.";
+        return result;
+    }
+
+    // Only the first caller for a digest signs it, the others find its result once they get the mutex.
+    boost::interprocess::named_mutex mutex(boost::interprocess::open_or_create, ipc_security::object_name("acsalt-sign-" + key).c_str(), ipc_security::owner_only());
+    boost::interprocess::scoped_lock<boost::interprocess::named_mutex> lock(mutex, boost::posix_time::microsec_clock::universal_time() + coalesce_timeout);
+    if (!lock.owns())
+    {
+        LOG_WARNING << L"A concurrent request for the same digest did not finish in time, signing without it.";
+        return sign();
+    }
+
+    if (find(key, result))
+    {
+        LOG_INFO << L"Using signature of a concurrent request.";
+        return result;
+    }
+
+    result = sign();
+    store(key, result);
+    return result;
+}
+
+bool signature_cache::find(const std::string& key, acs::signing_result& result)
+{
+    const trace::span span("signature cache read");
+
+    {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        const auto it = entries_.find(key);
+        if (it != entries_.end() && now() - it->second.created < ttl_seconds)
+        {
+            result = it->second.result;
+            return true;
+        }
+    }
+
+    const auto path = directory_ + encoder::to_wstring(key);
+    if (::GetFileAttributesW(path.c_str()) == INVALID_FILE_ATTRIBUTES)
+    {
+        return false;
+    }
+
+    entry e;
+    try
+    {
+        const auto jv = boost::json::parse(file::read(path));
+        e.created = jv.at("created").as_int64();
+        e.result.signature = encoder::base64_decode(boost::json::value_to<std::string>(jv.at("signature")));
+        e.result.certificate = boost::json::value_to<std::string>(jv.at("certificate"));
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_WARNING << L"Ignoring unreadable cached signature: " << exc;
+        return false;
+    }
+
+    if (now() - e.created >= ttl_seconds)
+    {
+        return false;
+    }
+
+    result = e.result;
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (entries_.size() >= max_entries)
+    {
+        entries_.clear();
+    }
+    entries_[key] = std::move(e);
+    return true;
+}
+
+void signature_cache::store(const std::string& key, const acs::signing_result& result)
+{
+    entry e = { now(), result };
+
+    try
+    {
+        boost::json::object jo;
+        jo["created"] = e.created;
+        jo["signature"] = encoder::base64_encode(result.signature);
+        jo["certificate"] = result.certificate;
+
+        // Written next to the final name and moved over it, so readers never see a partial file.
+        const auto path = directory_ + encoder::to_wstring(key);
+        const auto temp = path + L".tmp";
+        file::write(temp, boost::json::serialize(jo));
+        if (!::MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING))
+        {
+            throw win32_error("MoveFileExW");
+        }
+
+        prune();
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_WARNING << L"Failed to cache signature: " << exc;
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    if (entries_.size() >= max_entries)
+    {
+        entries_.clear();
+    }
+    entries_[key] = std::move(e);
+}
+
+void signature_cache::prune()
+{
+    WIN32_FIND_DATAW data;
+    HANDLE find = ::FindFirstFileW((directory_ + L"*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    ULARGE_INTEGER expiry;
+    {
+        FILETIME ft;
+        ::GetSystemTimeAsFileTime(&ft);
+        expiry.LowPart = ft.dwLowDateTime;
+        expiry.HighPart = ft.dwHighDateTime;
+        expiry.QuadPart -= ttl_seconds * 10000000ull;
+    }
+
+    // Expired files go first, then the oldest ones until the directory is back within bounds.
+    std::vector<std::pair<ULONGLONG, std::wstring>> files;
+    do
+    {
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            continue;
+        }
+
+        ULARGE_INTEGER written;
+        written.LowPart = data.ftLastWriteTime.dwLowDateTime;
+        written.HighPart = data.ftLastWriteTime.dwHighDateTime;
+        if (written.QuadPart < expiry.QuadPart)
+        {
+            ::DeleteFileW((directory_ + data.cFileName).c_str());
+            continue;
+        }
+        files.emplace_back(written.QuadPart, directory_ + data.cFileName);
+    } while (::FindNextFileW(find, &data));
+
+    ::FindClose(find);
+
+    if (files.size() <= max_files)
+    {
+        return;
+    }
+
+    const auto excess = files.begin() + static_cast<std::ptrdiff_t>(files.size() - max_files);
+    std::nth_element(files.begin(), excess, files.end());
+    for (auto it = files.begin(); it != excess; ++it)
+    {
+        ::DeleteFileW(it->second.c_str());
+    }
+}
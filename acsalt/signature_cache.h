@@ -0,0 +1,40 @@
+#pragma once
+
+#include "acs.h"
+
+// Signatures of digests signed before, kept on disk for a day and in memory for the life of the process.
+// Byte-identical files produce the same digest and RSA PKCS#1 v1.5 signatures are deterministic, so repeated
+// requests are answered locally. Concurrent requests for one digest, from any thread or process, wait for the
+// first one to finish instead of each going to the service, for up to the poll deadline. The directory is
+// private to the user.
+class signature_cache : boost::noncopyable
+{
+public:
+    static signature_cache& instance();
+
+    typedef std::function<acs::signing_result()> sign_fn;
+
+    // Returns the cached signature of `digest` (base64) for this algorithm and profile, or calls `sign` and
+    // caches its result.
+    acs::signing_result lookup(unsigned alg_id, const std::string& digest, const std::string& endpoint, const std::string& account,
+                               const std::string& profile, const sign_fn& sign);
+
+private:
+    signature_cache();
+
+    struct entry
+    {
+        std::int64_t created;
+        acs::signing_result result;
+    };
+
+    bool find(const std::string& key, acs::signing_result& result);
+
+    void store(const std::string& key, const acs::signing_result& result);
+
+    void prune();
+
+    std::wstring directory_;
+    boost::shared_mutex mutex_;
+    std::map<std::string, entry> entries_;
+};
@@ -0,0 +1,298 @@
+#include "pch.h"
+#include "timestamp_client.h"
+
+#include "exception_strm.h"
+#include "file.h"
+#include "logging.h"
+#include "scoped_cleanup.h"
+#include "trace.h"
+#include "win32_error.h"
+#include "winhttp_transport.h"
+
+#include <bcrypt.h>
+#include <imagehlp.h>
+#include <winhttp.h>
+
+#pragma comment(lib, "bcrypt")
+#pragma comment(lib, "imagehlp")
+
+namespace
+{
+    const DWORD encoding = X509_ASN_ENCODING | PKCS_7_ASN_ENCODING;
+
+    const std::size_t nonce_size = 8;
+
+    // Per server, transport errors only. A refused request goes to the next server right away.
+    const unsigned retries_per_url = 1;
+
+    struct hash_info
+    {
+        LPCSTR oid;
+        LPCWSTR cng_id;
+    };
+
+    hash_info hash_of(ALG_ID alg)
+    {
+        switch (alg)
+        {
+        case CALG_SHA_256:
+            return { szOID_NIST_sha256, BCRYPT_SHA256_ALGORITHM };
+        case CALG_SHA_384:
+            return { szOID_NIST_sha384, BCRYPT_SHA384_ALGORITHM };
+        case CALG_SHA_512:
+            return { szOID_NIST_sha512, BCRYPT_SHA512_ALGORITHM };
+        default:
+            throw std::invalid_argument("invalid alg_id");
+        }
+    }
+
+    std::string encode(LPCSTR type, const void* value)
+    {
+        DWORD size = 0;
+        if (!::CryptEncodeObjectEx(encoding, type, value, 0, nullptr, nullptr, &size))
+        {
+            throw win32_error("CryptEncodeObjectEx");
+        }
+
+        std::string encoded(size, 0);
+        if (!::CryptEncodeObjectEx(encoding, type, value, 0, nullptr, &encoded[0], &size))
+        {
+            throw win32_error("CryptEncodeObjectEx");
+        }
+        encoded.resize(size);
+        return encoded;
+    }
+
+    std::string message_param(HCRYPTMSG msg, DWORD param)
+    {
+        DWORD size = 0;
+        if (!::CryptMsgGetParam(msg, param, 0, nullptr, &size))
+        {
+            throw win32_error("CryptMsgGetParam");
+        }
+
+        std::string value(size, 0);
+        if (!::CryptMsgGetParam(msg, param, 0, &value[0], &size))
+        {
+            throw win32_error("CryptMsgGetParam");
+        }
+        value.resize(size);
+        return value;
+    }
+
+    std::string read_signature(HANDLE file)
+    {
+        DWORD count = 0;
+        if (!::ImageEnumerateCertificates(file, CERT_SECTION_TYPE_ANY, &count, nullptr, 0))
+        {
+            throw win32_error("ImageEnumerateCertificates");
+        }
+
+        if (!count)
+        {
+            throw std::invalid_argument("file is not signed");
+        }
+
+        WIN_CERTIFICATE header = {};
+        if (!::ImageGetCertificateHeader(file, 0, &header))
+        {
+            throw win32_error("ImageGetCertificateHeader");
+        }
+
+        std::vector<BYTE> buffer(header.dwLength, 0);
+        DWORD size = header.dwLength;
+        auto certificate = reinterpret_cast<LPWIN_CERTIFICATE>(buffer.data());
+        if (!::ImageGetCertificateData(file, 0, certificate, &size))
+        {
+            throw win32_error("ImageGetCertificateData");
+        }
+
+        return std::string(reinterpret_cast<const char*>(certificate->bCertificate), certificate->dwLength - offsetof(WIN_CERTIFICATE, bCertificate));
+    }
+
+    void replace_signature(HANDLE file, const std::string& signature)
+    {
+        const DWORD header_size = offsetof(WIN_CERTIFICATE, bCertificate);
+        std::vector<BYTE> buffer(header_size + signature.size(), 0);
+        auto certificate = reinterpret_cast<LPWIN_CERTIFICATE>(buffer.data());
+        certificate->dwLength = static_cast<DWORD>(buffer.size());
+        certificate->wRevision = WIN_CERT_REVISION_2_0;
+        certificate->wCertificateType = WIN_CERT_TYPE_PKCS_SIGNED_DATA;
+        std::memcpy(certificate->bCertificate, signature.data(), signature.size());
+
+        if (!::ImageRemoveCertificate(file, 0))
+        {
+            throw win32_error("ImageRemoveCertificate");
+        }
+
+        DWORD index = 0;
+        if (!::ImageAddCertificate(file, certificate, &index))
+        {
+            throw win32_error("ImageAddCertificate");
+        }
+    }
+}
+
+timestamp_client::timestamp_client(const std::vector<std::wstring>& urls) :
+    timestamp_client(urls, std::unique_ptr<transport>(new winhttp_transport()))
+{
+}
+
+timestamp_client::timestamp_client(const std::vector<std::wstring>& urls, std::unique_ptr<transport> backend) :
+    urls_(urls),
+    preferred_(0),
+    client_(std::move(backend))
+{
+    if (urls_.empty())
+    {
+        throw std::invalid_argument("no timestamp server");
+    }
+}
+
+std::string timestamp_client::stamp(const std::string& data, ALG_ID alg)
+{
+    const trace::span span("timestamp");
+    const auto hash = hash_of(alg);
+
+    std::string imprint(64, 0);
+    DWORD imprint_size = static_cast<DWORD>(imprint.size());
+    if (!::CryptHashCertificate2(hash.cng_id, 0, nullptr, reinterpret_cast<const BYTE*>(data.data()), static_cast<DWORD>(data.size()),
+                                 reinterpret_cast<BYTE*>(&imprint[0]), &imprint_size))
+    {
+        throw win32_error("CryptHashCertificate2");
+    }
+
+    BYTE nonce_bytes[nonce_size];
+    const auto status = ::BCryptGenRandom(nullptr, nonce_bytes, nonce_size, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        throw std::system_error(HRESULT_FROM_NT(status), std::system_category(), "BCryptGenRandom");
+    }
+
+    // Little endian, keep the most significant byte positive.
+    nonce_bytes[nonce_size - 1] &= 0x7f;
+    const CRYPT_INTEGER_BLOB nonce = { nonce_size, nonce_bytes };
+
+    CRYPT_TIMESTAMP_REQUEST request = {};
+    request.dwVersion = TIMESTAMP_VERSION;
+    request.HashAlgorithm.pszObjId = const_cast<LPSTR>(hash.oid);
+    request.HashedMessage.cbData = imprint_size;
+    request.HashedMessage.pbData = reinterpret_cast<BYTE*>(&imprint[0]);
+    request.Nonce = nonce;
+    request.fCertReq = TRUE;
+
+    const auto encoded = encode(TIMESTAMP_REQUEST, &request);
+
+    const auto first = preferred_.load();
+    for (std::size_t i = 0; i < urls_.size(); ++i)
+    {
+        const auto index = (first + i) % urls_.size();
+        try
+        {
+            auto token = request_token(urls_[index], encoded, nonce, data);
+            preferred_ = index;
+            return token;
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_WARNING << L"Timestamp server " << urls_[index] << L" failed: " << exc;
+        }
+    }
+
+    throw std::runtime_error("No timestamp server issued a timestamp.");
+}
+
+std::string timestamp_client::request_token(const std::wstring& url, const std::string& request, const CRYPT_INTEGER_BLOB& nonce, const std::string& data)
+{
+    http_client::header_map headers;
+    headers[L"Content-Type"] = L"application/timestamp-query";
+    headers[L"Accept"] = L"application/timestamp-reply";
+
+    const auto resp = client_.post(url, request, headers, retries_per_url);
+    if (resp.status_code != HTTP_STATUS_OK)
+    {
+        throw std::runtime_error("Unexpected HTTP status " + std::to_string(resp.status_code));
+    }
+
+    PCRYPT_TIMESTAMP_RESPONSE reply = nullptr;
+    DWORD reply_size = 0;
+    if (!::CryptDecodeObjectEx(encoding, TIMESTAMP_RESPONSE, reinterpret_cast<const BYTE*>(resp.body.data()), static_cast<DWORD>(resp.body.size()),
+                               CRYPT_DECODE_ALLOC_FLAG, nullptr, &reply, &reply_size))
+    {
+        throw win32_error("CryptDecodeObjectEx");
+    }
+
+    const auto reply_grd = scoped_cleanup([reply]() { ::LocalFree(reply); });
+
+    if (reply->dwStatus != TIMESTAMP_STATUS_GRANTED && reply->dwStatus != TIMESTAMP_STATUS_GRANTED_WITH_MODS)
+    {
+        throw std::runtime_error("Timestamp request rejected with status " + std::to_string(reply->dwStatus));
+    }
+
+    // Checks the TSA signature and that the token covers `data`.
+    PCRYPT_TIMESTAMP_CONTEXT context = nullptr;
+    PCCERT_CONTEXT signer = nullptr;
+    HCERTSTORE store = nullptr;
+    if (!::CryptVerifyTimeStampSignature(reply->ContentInfo.pbData, reply->ContentInfo.cbData, reinterpret_cast<const BYTE*>(data.data()), static_cast<DWORD>(data.size()),
+                                         nullptr, &context, &signer, &store))
+    {
+        throw win32_error("CryptVerifyTimeStampSignature");
+    }
+
+    const auto context_grd = scoped_cleanup([context, signer, store]()
+        {
+            ::CryptMemFree(context);
+            ::CertFreeCertificateContext(signer);
+            ::CertCloseStore(store, 0);
+        });
+
+    if (!::CertCompareIntegerBlob(&context->pTimeStamp->Nonce, const_cast<PCRYPT_INTEGER_BLOB>(&nonce)))
+    {
+        throw std::runtime_error("Timestamp nonce does not match the request.");
+    }
+
+    return std::string(reinterpret_cast<const char*>(reply->ContentInfo.pbData), reply->ContentInfo.cbData);
+}
+
+void timestamp_client::stamp_file(const std::wstring& path, ALG_ID alg)
+{
+    file::handle file = ::CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+    if (!file.valid())
+    {
+        throw win32_error("CreateFileW");
+    }
+
+    const auto signature = read_signature(file);
+
+    HCRYPTMSG msg = ::CryptMsgOpenToDecode(encoding, 0, 0, 0, nullptr, nullptr);
+    if (!msg)
+    {
+        throw win32_error("CryptMsgOpenToDecode");
+    }
+
+    const auto msg_grd = scoped_cleanup([msg]() { ::CryptMsgClose(msg); });
+
+    if (!::CryptMsgUpdate(msg, reinterpret_cast<const BYTE*>(signature.data()), static_cast<DWORD>(signature.size()), TRUE))
+    {
+        throw win32_error("CryptMsgUpdate");
+    }
+
+    // The timestamp covers the signer's signature value, as in signtool's RFC 3161 counter-signatures.
+    auto token = stamp(message_param(msg, CMSG_ENCRYPTED_DIGEST), alg);
+
+    CRYPT_ATTR_BLOB value = { static_cast<DWORD>(token.size()), reinterpret_cast<BYTE*>(&token[0]) };
+    CRYPT_ATTRIBUTE attribute = { const_cast<LPSTR>(szOID_RFC3161_counterSign), 1, &value };
+    auto encoded = encode(PKCS_ATTRIBUTE, &attribute);
+
+    CMSG_CTRL_ADD_SIGNER_UNAUTH_ATTR_PARA para = {};
+    para.cbSize = sizeof(para);
+    para.dwSignerIndex = 0;
+    para.blob.cbData = static_cast<DWORD>(encoded.size());
+    para.blob.pbData = reinterpret_cast<BYTE*>(&encoded[0]);
+    if (!::CryptMsgControl(msg, 0, CMSG_CTRL_ADD_SIGNER_UNAUTH_ATTR, &para))
+    {
+        throw win32_error("CryptMsgControl");
+    }
+
+    replace_signature(file, message_param(msg, CMSG_ENCODED_MESSAGE));
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "http_client.h"
+
+// RFC 3161 client. Requests go through http_client and so share its pooled connections; one instance serves
+// any number of threads, each of which has its own request in flight.
+class timestamp_client : private boost::noncopyable
+{
+public:
+    // `urls` are tried in order until one answers, the last one that did is tried first next time.
+    explicit timestamp_client(const std::vector<std::wstring>& urls);
+
+    timestamp_client(const std::vector<std::wstring>& urls, std::unique_ptr<transport> backend);
+
+    // Returns the DER encoded timestamp token over `data`, verified against it and the request nonce.
+    std::string stamp(const std::string& data, ALG_ID alg);
+
+    // Counter-signs the Authenticode signature of a signed PE file with a timestamp, like signtool /tr.
+    void stamp_file(const std::wstring& path, ALG_ID alg);
+
+private:
+    std::vector<std::wstring> urls_;
+    std::atomic<std::size_t> preferred_;
+    http_client client_;
+
+    std::string request_token(const std::wstring& url, const std::string& request, const CRYPT_INTEGER_BLOB& nonce, const std::string& data);
+};
@@ -0,0 +1,122 @@
+#include "pch.h"
+#include "token_cache.h"
+
+#include "ipc_security.h"
+
+namespace
+{
+    const unsigned layout_version = 1;
+    const std::size_t slot_count = 16;
+    const std::size_t max_token_length = 4096;
+
+    // A writer that died mid-update leaves the slot odd forever, readers treat it as a miss after this many tries.
+    const unsigned max_read_spins = 1000;
+
+    struct slot
+    {
+        // Odd while the slot is being written. Readers retry until they see the same even value before and after copying.
+        std::atomic<std::uint32_t> sequence;
+        std::uint64_t key;
+        std::int64_t issued;
+        std::int64_t expires;
+        std::uint32_t length;
+        wchar_t token[max_token_length];
+    };
+}
+
+struct token_cache::segment
+{
+    std::uint32_t version;
+    slot slots[slot_count];
+};
+
+token_cache& token_cache::instance()
+{
+    static token_cache cache;
+    return cache;
+}
+
+token_cache::token_cache() :
+    shm_(boost::interprocess::open_or_create, ipc_security::object_name("acsalt-token-cache").c_str(), boost::interprocess::read_write, sizeof(segment),
+         ipc_security::owner_only()),
+    region_(shm_, boost::interprocess::read_write),
+    segment_(static_cast<segment*>(region_.get_address()))
+{
+    // Fresh segments are zero-filled, which is a valid empty cache.
+    if (segment_->version != 0 && segment_->version != layout_version)
+    {
+        throw std::runtime_error("Token cache segment has an incompatible layout.");
+    }
+    segment_->version = layout_version;
+}
+
+bool token_cache::read(std::uint64_t key, entry& e) const
+{
+    for (const auto& s : segment_->slots)
+    {
+        for (unsigned spin = 0; spin < max_read_spins; ++spin)
+        {
+            const auto before = s.sequence.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+                ::SwitchToThread();
+                continue;
+            }
+
+            if (s.key != key || s.length == 0)
+            {
+                break;
+            }
+
+            const auto length = std::min<std::size_t>(s.length, max_token_length);
+            e.token.assign(s.token, s.token + length);
+            e.issued = s.issued;
+            e.expires = s.expires;
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (s.sequence.load(std::memory_order_relaxed) == before)
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void token_cache::write(std::uint64_t key, const entry& e)
+{
+    if (e.token.size() > max_token_length)
+    {
+        return;
+    }
+
+    // Reuse the slot of the same credentials, otherwise replace the one that expires first.
+    auto target = &segment_->slots[0];
+    for (auto& s : segment_->slots)
+    {
+        if (s.key == key)
+        {
+            target = &s;
+            break;
+        }
+
+        if (s.expires < target->expires)
+        {
+            target = &s;
+        }
+    }
+
+    // Writers are serialized, so an odd value here was left behind by a writer that died. Just take it over.
+    const auto sequence = target->sequence.load(std::memory_order_relaxed) | 1;
+    target->sequence.store(sequence, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    target->key = key;
+    target->issued = e.issued;
+    target->expires = e.expires;
+    target->length = static_cast<std::uint32_t>(e.token.size());
+    std::copy(e.token.begin(), e.token.end(), target->token);
+
+    target->sequence.store(sequence + 1, std::memory_order_release);
+}
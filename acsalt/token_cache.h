@@ -0,0 +1,32 @@
+#pragma once
+
+// Copy of the bearer tokens in a named shared memory segment, so processes don't have to read and decrypt
+// the token file for every signature. The segment is named after and restricted to the current user. Reads are
+// lock-free (seqlock), writers must be serialized by the caller.
+class token_cache : boost::noncopyable
+{
+public:
+    struct entry
+    {
+        std::wstring token;
+        std::int64_t issued;
+        std::int64_t expires;
+    };
+
+    // Opens or creates the segment on first use. Throws if shared memory is not available.
+    static token_cache& instance();
+
+    // `key` identifies the credentials the token belongs to.
+    bool read(std::uint64_t key, entry& e) const;
+
+    void write(std::uint64_t key, const entry& e);
+
+private:
+    token_cache();
+
+    struct segment;
+
+    boost::interprocess::windows_shared_memory shm_;
+    boost::interprocess::mapped_region region_;
+    segment* segment_;
+};
@@ -0,0 +1,417 @@
+#include "pch.h"
+
+#include "token_manager.h"
+
+#include "encoder.h"
+#include "exception_strm.h"
+#include "file.h"
+#include "logging.h"
+#include "login_gate.h"
+#include "scoped_cleanup.h"
+#include "token_cache.h"
+#include "trace.h"
+#include "win32_error.h"
+
+namespace
+{
+    typedef std::chrono::system_clock sys_clock;
+
+    // Tokens are refreshed once 80% of their lifetime has passed, but never earlier than 5 minutes before they expire.
+    const std::chrono::seconds max_refresh_margin(300);
+
+    // Tokens this close to expiration are not sent anymore, they could expire on the way.
+    const std::chrono::seconds expiration_skew(30);
+
+    // Delay before the background refresh tries again after a failed login.
+    const boost::chrono::seconds refresh_retry_delay(30);
+
+    sys_clock::time_point refresh_time(sys_clock::time_point issued, sys_clock::time_point expires)
+    {
+        auto margin = std::chrono::duration_cast<std::chrono::seconds>(expires - issued) / 5;
+        if (margin > max_refresh_margin)
+        {
+            margin = max_refresh_margin;
+        }
+        return expires - margin;
+    }
+
+    // Stale tokens still work, but are due for a refresh.
+    bool is_stale(const std::wstring& token, sys_clock::time_point issued, sys_clock::time_point expires, sys_clock::time_point now)
+    {
+        return token.empty() || now >= std::min(refresh_time(issued, expires), expires - expiration_skew);
+    }
+
+    std::int64_t to_unix(sys_clock::time_point tp)
+    {
+        return static_cast<std::int64_t>(sys_clock::to_time_t(tp));
+    }
+
+    sys_clock::time_point from_unix(std::int64_t t)
+    {
+        return sys_clock::from_time_t(static_cast<std::time_t>(t));
+    }
+
+    // Reads the `exp` claim of a JWT access token. Returns `fallback` if the token is not a JWT.
+    sys_clock::time_point jwt_expiry(const std::wstring& token, sys_clock::time_point fallback)
+    {
+        const auto first = token.find(L'.');
+        const auto second = (first == token.npos) ? token.npos : token.find(L'.', first + 1);
+        if (second == token.npos)
+        {
+            return fallback;
+        }
+
+        auto payload = encoder::to_string(token.substr(first + 1, second - first - 1));
+        std::replace(payload.begin(), payload.end(), '-', '+');
+        std::replace(payload.begin(), payload.end(), '_', '/');
+        payload.append((4 - payload.size() % 4) % 4, '=');
+
+        try
+        {
+            const auto jv = boost::json::parse(encoder::base64_decode(payload));
+            return from_unix(jv.at("exp").to_number<std::int64_t>());
+        }
+        catch (const std::exception&)
+        {
+            return fallback;
+        }
+    }
+}
+
+token_manager::token_manager(http_client& client, const std::wstring& authority, const std::wstring& tenant, const std::wstring& client_id, const std::wstring& client_secret) :
+    client_(client),
+    authority_(boost::trim_right_copy_if(authority, boost::is_any_of(L"/"))),
+    tenant_(tenant),
+    client_id_(client_id),
+    client_secret_(client_secret),
+    token_file_(4096, 0),
+    cache_key_(std::hash<std::wstring>()(authority_ + L'\n' + tenant + L'\n' + client_id + L'\n' + client_secret)),
+    stopping_(false),
+    module_(nullptr),
+    refresher_(nullptr)
+{
+    auto size = ::ExpandEnvironmentStringsW(L"%USERPROFILE%\\.acsalt", &token_file_[0], static_cast<DWORD>(token_file_.size()));
+    token_file_.resize(size);
+
+    if (!load_cached_token())
+    {
+        login_gate::instance().exclusive([this]() { load_token(); });
+    }
+
+    if (!::GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(&token_manager::refresher_main), &module_))
+    {
+        throw win32_error("GetModuleHandleExW");
+    }
+
+    refresher_ = ::CreateThread(nullptr, 0, &token_manager::refresher_main, this, 0, nullptr);
+    if (!refresher_)
+    {
+        const auto error = win32_error("CreateThread");
+        ::FreeLibrary(module_);
+        throw error;
+    }
+}
+
+token_manager::~token_manager()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+
+    changed_.notify_all();
+
+    // Returns at once unless a background login is in flight, which is bounded by the HTTP timeouts.
+    ::WaitForSingleObject(refresher_, INFINITE);
+    ::CloseHandle(refresher_);
+}
+
+std::wstring token_manager::token()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (!token_.empty() && clock::now() + expiration_skew < expires_)
+        {
+            return token_;
+        }
+    }
+
+    LOG_INFO << L"Authentication token is missing or expired, requesting one now...";
+    login(std::wstring());
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return token_;
+}
+
+std::wstring token_manager::refresh(const std::wstring& rejected)
+{
+    LOG_INFO << L"Authentication token was rejected, refreshing...";
+    login(rejected);
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return token_;
+}
+
+void token_manager::login(const std::wstring& rejected)
+{
+    const trace::span span("login");
+
+    boost::lock_guard<boost::mutex> login_lock(login_mutex_);
+
+    // Another thread may have logged in while we were waiting for the lock.
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (!token_.empty() && token_ != rejected && !stale(clock::now()))
+        {
+            return;
+        }
+    }
+
+    // Only one process logs in, the others wait for it and take its token from the cache.
+    auto& gate = login_gate::instance();
+    const auto satisfied = [&rejected](const token_cache::entry& e)
+        {
+            return e.token != rejected && !is_stale(e.token, from_unix(e.issued), from_unix(e.expires), clock::now());
+        };
+
+    if (!gate.begin(cache_key_, satisfied))
+    {
+        LOG_INFO << L"Picked up the token of another process.";
+        load_cached_token();
+        return;
+    }
+
+    const auto gate_grd = scoped_cleanup([this, &gate]() { gate.end(cache_key_); });
+
+    LOG_INFO << L"Logging in tenant: " << tenant_ << L" client id: " << client_id_;
+
+    http_client::header_map headers;
+    headers[L"Content-Type"] = L"application/x-www-form-urlencoded";
+
+    static const auto scope = encoder::url_encode(L"api://cf2ab426-f71a-4b61-bb8a-9e505b85bc2e//.default");
+
+    std::wostringstream body;
+    body << L"client_id=" << encoder::url_encode(client_id_)
+        << L"&grant_type=client_credentials"
+        << L"&client_info=1"
+        << L"&client_secret=" << encoder::url_encode(client_secret_)
+        << L"&scope=" << scope;
+
+    const std::wstring url = authority_ + L"/" + tenant_ + L"/oauth2/v2.0/token";
+
+    auto resp = client_.post_hedged(url, encoder::to_string(body.str()), headers, 2);
+    if (resp.status_code != 200)
+    {
+        std::ostringstream os;
+        os << "Login failed, http status: " << resp.status_code << ", msg: " << resp.body;
+        throw std::system_error(ERROR_ACCESS_DENIED, std::system_category(), os.str());
+    }
+
+    LOG_INFO << L"Login succeeded.";
+
+    // The DOM only lives until the strings are copied out, one arena for all of it.
+    boost::json::monotonic_resource arena;
+    const auto jv = boost::json::parse(resp.body, &arena);
+    const auto token_type = boost::json::value_to<std::string>(jv.at("token_type"));
+    const auto token = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("access_token")));
+
+    const auto now = clock::now();
+    auto expires = jwt_expiry(token, now);
+
+    // expires_in is a number in v2.0 responses, but older endpoints send it as a string.
+    const auto expires_in = jv.as_object().if_contains("expires_in");
+    if (expires_in)
+    {
+        const auto seconds = expires_in->is_string() ? std::stoll(std::string(expires_in->get_string())) : expires_in->to_number<long long>();
+        expires = now + std::chrono::seconds(seconds);
+    }
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        token_ = encoder::to_wstring(token_type) + L" " + token;
+        issued_ = now;
+        expires_ = expires;
+    }
+
+    changed_.notify_all();
+
+    store_token();
+}
+
+void token_manager::store_token() const
+{
+    LOG_DEBUG << L"Storing token...";
+
+    boost::json::object jo;
+    jo["authority"] = encoder::to_string(authority_);
+    jo["tenant"] = encoder::to_string(tenant_);
+    jo["id"] = encoder::to_string(client_id_);
+    jo["secret"] = encoder::to_string(client_secret_);
+    jo["token"] = encoder::to_string(token_);
+    jo["issued"] = to_unix(issued_);
+    jo["expires"] = to_unix(expires_);
+
+    const auto encrypted = encoder::encrypt_dpapi(boost::json::serialize(jo));
+
+    login_gate::instance().exclusive([&]()
+        {
+            cache_token();
+            file::write(token_file_, encrypted);
+        });
+
+    LOG_DEBUG << L"Token stored.";
+}
+
+void token_manager::load_token()
+{
+    const trace::span span("token load");
+
+    LOG_DEBUG << L"Loading token...";
+
+    if (::GetFileAttributesW(token_file_.c_str()) == INVALID_FILE_ATTRIBUTES)
+    {
+        LOG_INFO << L"Token file doesn't exist, not logged in yet.";
+        return;
+    }
+
+    try
+    {
+        const auto jv = boost::json::parse(encoder::decrypt_dpapi(file::read(token_file_)));
+        const auto stored_tenant = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("tenant")));
+        const auto stored_client_id = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("id")));
+        const auto stored_client_secret = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("secret")));
+        // Token files written by older versions were always issued by the public cloud.
+        const auto stored_authority = jv.as_object().contains("authority") ? encoder::to_wstring(boost::json::value_to<std::string>(jv.at("authority"))) : std::wstring(L"https://login.microsoftonline.com");
+        if (stored_authority != authority_ || stored_tenant != tenant_ || stored_client_id != client_id_ || stored_client_secret != client_secret_)
+        {
+            LOG_INFO << L"Found a cached token, but the credentials don't match.";
+            return;
+        }
+
+        const auto token = encoder::to_wstring(boost::json::value_to<std::string>(jv.at("token")));
+
+        // Token files written by older versions don't record the lifetime, fall back to the JWT claims.
+        const auto& jo = jv.as_object();
+        const auto expires = jo.contains("expires") ? from_unix(jo.at("expires").to_number<std::int64_t>()) : jwt_expiry(token, clock::now());
+        const auto issued = jo.contains("issued") ? from_unix(jo.at("issued").to_number<std::int64_t>()) : expires - std::chrono::hours(1);
+
+        LOG_INFO << L"Found a cached token for current credentials.";
+        adopt(token, issued, expires);
+
+        // Later loads in this and other processes are served from shared memory.
+        cache_token();
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_WARNING << L"Failed to load token file: " << exc;
+    }
+}
+
+bool token_manager::load_cached_token()
+{
+    const trace::span span("token cache read");
+
+    try
+    {
+        token_cache::entry e;
+        if (!token_cache::instance().read(cache_key_, e))
+        {
+            return false;
+        }
+
+        adopt(e.token, from_unix(e.issued), from_unix(e.expires));
+        return true;
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_WARNING << L"Failed to read the token cache: " << exc;
+        return false;
+    }
+}
+
+void token_manager::cache_token() const
+{
+    try
+    {
+        token_cache::entry e;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            e.token = token_;
+            e.issued = to_unix(issued_);
+            e.expires = to_unix(expires_);
+        }
+
+        token_cache::instance().write(cache_key_, e);
+    }
+    catch (const std::exception& exc)
+    {
+        LOG_WARNING << L"Failed to update the token cache: " << exc;
+    }
+}
+
+void token_manager::adopt(const std::wstring& token, clock::time_point issued, clock::time_point expires)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (token_.empty() || issued >= issued_)
+    {
+        token_ = token;
+        issued_ = issued;
+        expires_ = expires;
+    }
+}
+
+bool token_manager::stale(clock::time_point now) const
+{
+    return is_stale(token_, issued_, expires_, now);
+}
+
+void token_manager::refresh_loop()
+{
+    for (;;)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            while (!stopping_ && token_.empty())
+            {
+                changed_.wait(lock);
+            }
+
+            if (stopping_)
+            {
+                return;
+            }
+
+            const auto now = clock::now();
+            if (!stale(now))
+            {
+                const auto at = std::min(refresh_time(issued_, expires_), expires_ - expiration_skew);
+                const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(at - now);
+                changed_.wait_for(lock, boost::chrono::milliseconds(delay.count()));
+                continue;
+            }
+        }
+
+        try
+        {
+            LOG_INFO << L"Authentication token is about to expire, refreshing in background...";
+            login(std::wstring());
+        }
+        catch (const std::exception& exc)
+        {
+            LOG_WARNING << L"Background token refresh failed: " << exc;
+
+            boost::unique_lock<boost::mutex> lock(mutex_);
+            changed_.wait_for(lock, refresh_retry_delay, [this]() { return stopping_; });
+        }
+    }
+}
+
+DWORD WINAPI token_manager::refresher_main(LPVOID param)
+{
+    const auto self = static_cast<token_manager*>(param);
+    const auto module = self->module_;
+    self->refresh_loop();
+
+    // The destructor waits for this thread, so `self` is not touched past this point.
+    ::FreeLibraryAndExitThread(module, 0);
+}
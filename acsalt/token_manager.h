@@ -0,0 +1,63 @@
+#pragma once
+
+#include "http_client.h"
+
+// Owns the OAuth bearer token of one set of credentials: loads it from the token file, tracks when it expires,
+// refreshes it in the background shortly before that and logs in again only when it is missing or rejected.
+class token_manager : boost::noncopyable
+{
+public:
+    token_manager(http_client& client, const std::wstring& authority, const std::wstring& tenant, const std::wstring& client_id, const std::wstring& client_secret);
+
+    ~token_manager();
+
+    // Returns a token that is not known to be expired, logging in first if necessary.
+    std::wstring token();
+
+    // Called when the service answered 401 to `rejected`. Logs in again unless the token was already replaced.
+    std::wstring refresh(const std::wstring& rejected);
+
+private:
+    typedef std::chrono::system_clock clock;
+
+    void login(const std::wstring& rejected);
+
+    void store_token() const;
+
+    // Cold start path, callers must be inside login_gate::exclusive.
+    void load_token();
+
+    bool load_cached_token();
+
+    // Publishes the current token to the shared memory cache, callers must be inside login_gate::exclusive.
+    void cache_token() const;
+
+    // Takes over the token unless the current one is newer.
+    void adopt(const std::wstring& token, clock::time_point issued, clock::time_point expires);
+
+    bool stale(clock::time_point now) const;
+
+    void refresh_loop();
+
+    static DWORD WINAPI refresher_main(LPVOID param);
+
+    http_client& client_;
+    std::wstring authority_;
+    std::wstring tenant_;
+    std::wstring client_id_;
+    std::wstring client_secret_;
+    std::wstring token_file_;
+    std::uint64_t cache_key_;
+
+    boost::mutex login_mutex_;
+    mutable boost::mutex mutex_;
+    boost::condition_variable changed_;
+    std::wstring token_;
+    clock::time_point issued_;
+    clock::time_point expires_;
+    bool stopping_;
+
+    // The refresher holds a reference to the DLL, so it is never unloaded under the running thread.
+    HMODULE module_;
+    HANDLE refresher_;
+};
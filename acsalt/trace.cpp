@@ -0,0 +1,170 @@
+#include "pch.h"
+#include "trace.h"
+
+#include "file.h"
+#include "ipc_security.h"
+
+namespace
+{
+    struct event
+    {
+        const char* name;
+        std::int64_t begin;
+        std::int64_t end;
+    };
+
+    // Each thread appends to its own buffer, the mutex is only contended while flush() takes the events out.
+    struct thread_buffer
+    {
+        boost::mutex mutex;
+        DWORD thread_id;
+        std::vector<event> events;
+    };
+
+    struct registry
+    {
+        boost::mutex mutex;
+        std::vector<std::shared_ptr<thread_buffer>> buffers;
+    };
+
+    registry& buffers()
+    {
+        // Intentionally leaked, threads may still finish spans while the process shuts down.
+        static registry* r = new registry();
+        return *r;
+    }
+
+    thread_buffer& local_buffer()
+    {
+        thread_local std::shared_ptr<thread_buffer> buffer;
+        if (!buffer)
+        {
+            buffer = std::make_shared<thread_buffer>();
+            buffer->thread_id = ::GetCurrentThreadId();
+            buffer->events.reserve(256);
+
+            auto& r = buffers();
+            boost::lock_guard<boost::mutex> lock(r.mutex);
+            r.buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    // The performance counter is consistent across processes, so spans of parallel signtool runs line up.
+    std::int64_t now_us()
+    {
+        static const auto frequency = []()
+            {
+                LARGE_INTEGER f;
+                ::QueryPerformanceFrequency(&f);
+                return f.QuadPart;
+            }();
+
+        LARGE_INTEGER counter;
+        ::QueryPerformanceCounter(&counter);
+        return counter.QuadPart / frequency * 1000000 + counter.QuadPart % frequency * 1000000 / frequency;
+    }
+
+    std::wstring trace_file()
+    {
+        const DWORD size = ::GetEnvironmentVariableW(L"ACSALT_TRACE", nullptr, 0);
+        if (!size)
+        {
+            return std::wstring();
+        }
+
+        std::wstring path(size, 0);
+        path.resize(::GetEnvironmentVariableW(L"ACSALT_TRACE", &path[0], size));
+        return path;
+    }
+
+    const std::wstring& path()
+    {
+        static const auto p = trace_file();
+        return p;
+    }
+}
+
+namespace trace
+{
+
+bool enabled()
+{
+    static const bool e = !path().empty();
+    return e;
+}
+
+span::span(const char* name) :
+    name_(name),
+    begin_(enabled() ? now_us() : 0)
+{
+}
+
+span::~span()
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    const event e = { name_, begin_, now_us() };
+
+    auto& buffer = local_buffer();
+    boost::lock_guard<boost::mutex> lock(buffer.mutex);
+    buffer.events.push_back(e);
+}
+
+void flush()
+{
+    if (!enabled())
+    {
+        return;
+    }
+
+    const auto pid = ::GetCurrentProcessId();
+
+    std::string out;
+    {
+        auto& r = buffers();
+        boost::lock_guard<boost::mutex> lock(r.mutex);
+        for (auto it = r.buffers.begin(); it != r.buffers.end();)
+        {
+            std::vector<event> events;
+            {
+                boost::lock_guard<boost::mutex> buffer_lock((*it)->mutex);
+                events.swap((*it)->events);
+                (*it)->events.reserve(events.size());
+            }
+
+            for (const auto& e : events)
+            {
+                char line[256];
+                const auto length = std::snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%lu,\"tid\":%lu},\n",
+                                                  e.name, static_cast<long long>(e.begin), static_cast<long long>(e.end - e.begin), pid, (*it)->thread_id);
+                if (length > 0)
+                {
+                    out.append(line, std::min<std::size_t>(length, sizeof(line) - 1));
+                }
+            }
+
+            // Only the registry still holds buffers of threads that have exited.
+            it = it->use_count() == 1 ? r.buffers.erase(it) : std::next(it);
+        }
+    }
+
+    if (out.empty())
+    {
+        return;
+    }
+
+    // Chrome trace array format, the closing bracket is optional so every process can keep appending.
+    boost::interprocess::named_mutex mutex(boost::interprocess::open_or_create, ipc_security::object_name("acsalt-trace").c_str(), ipc_security::owner_only());
+    boost::interprocess::scoped_lock<boost::interprocess::named_mutex> lock(mutex);
+    if (::GetFileAttributesW(path().c_str()) == INVALID_FILE_ATTRIBUTES)
+    {
+        out.insert(0, "[\n");
+    }
+    file::append(path(), out);
+}
+
+}
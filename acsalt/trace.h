@@ -0,0 +1,25 @@
+#pragma once
+
+// Latency tracing. When the ACSALT_TRACE environment variable names a file, spans are recorded into per-thread
+// buffers and flush() appends them to that file in Chrome trace JSON format. All processes of a run can share
+// one file, which then loads as a single timeline in Perfetto or chrome://tracing.
+namespace trace
+{
+    bool enabled();
+
+    // Records the time between construction and destruction. `name` must outlive the process, use literals.
+    class span : boost::noncopyable
+    {
+    public:
+        explicit span(const char* name);
+
+        ~span();
+
+    private:
+        const char* name_;
+        std::int64_t begin_;
+    };
+
+    // Writes out the spans recorded so far by all threads of this process.
+    void flush();
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "flat_headers.h"
+
+// Performs a single HTTP exchange. http_client adds retries on top and passes its timeouts and proxy along,
+// so backends only have to move bytes and keep their connections alive.
+class transport : boost::noncopyable
+{
+public:
+    typedef flat_headers header_map;
+
+    struct response
+    {
+        DWORD status_code;
+        header_map headers;
+        std::string body;
+    };
+
+    // Receives the body as it arrives instead of it being collected in response::body.
+    class body_sink
+    {
+    public:
+        virtual ~body_sink() {}
+
+        // Called for every attempt once the status and headers are in. Returning false leaves the body in
+        // response::body, e.g. for error responses.
+        virtual bool begin(const response& resp) = 0;
+
+        virtual void write(const char* data, std::size_t size) = 0;
+    };
+
+    // Lets another thread abort a request in flight, like the copy of a hedged request that lost the race.
+    class cancellation : boost::noncopyable
+    {
+    public:
+        cancellation() :
+            cancelled_(false)
+        {
+        }
+
+        // Aborts the attached request, and any request attached later. The aborted send throws.
+        void cancel()
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            cancelled_ = true;
+            if (abort_)
+            {
+                abort_();
+                abort_ = nullptr;
+            }
+        }
+
+        bool cancelled() const
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            return cancelled_;
+        }
+
+        // For backends, `abort` makes the blocking send fail. Returns false if the request is cancelled already.
+        bool attach(std::function<void()> abort)
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            if (cancelled_)
+            {
+                return false;
+            }
+            abort_ = std::move(abort);
+            return true;
+        }
+
+        // Returns false if `abort` has run, the backend must not release what it released again.
+        bool detach()
+        {
+            boost::lock_guard<boost::mutex> lock(mutex_);
+            const bool attached = static_cast<bool>(abort_);
+            abort_ = nullptr;
+            return attached;
+        }
+
+    private:
+        mutable boost::mutex mutex_;
+        bool cancelled_;
+        std::function<void()> abort_;
+    };
+
+    struct options
+    {
+        options() :
+            sink(nullptr),
+            separate_connection(false),
+            cancel(nullptr)
+        {
+        }
+
+        // Resolve, connect, send and receive timeouts in seconds.
+        std::tuple<int, int, int, int> timeouts;
+        std::wstring proxy;
+        body_sink* sink;
+
+        // Keeps the request off the connections the other requests share, for the second copy of a hedged request.
+        bool separate_connection;
+
+        cancellation* cancel;
+    };
+
+    static const DWORD status_unknown = static_cast<DWORD>(-1);
+
+    virtual ~transport() {}
+
+    // Throws on transport errors, HTTP errors are returned as the status code.
+    virtual response send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, const options& opts) = 0;
+};
@@ -0,0 +1,249 @@
+#include "pch.h"
+#include "winhttp_transport.h"
+
+#include "logging.h"
+#include "scoped_cleanup.h"
+#include "trace.h"
+#include "win32_error.h"
+
+transport::response winhttp_transport::send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, const options& opts)
+{
+    response resp;
+    resp.status_code = status_unknown;
+
+    URL_COMPONENTS components = { 0 };
+    components.dwStructSize = sizeof(components);
+    components.dwSchemeLength = 1;
+    components.dwHostNameLength = 1;
+    components.dwUrlPathLength = 1;
+    if (!::WinHttpCrackUrl(url.c_str(), 0, 0, &components))
+    {
+        throw win32_error("WinHttpCrackUrl");
+    }
+
+    connection_pool::key key;
+    key.scheme = components.nScheme;
+    key.host.assign(components.lpszHostName, components.lpszHostName + components.dwHostNameLength);
+    key.port = components.nPort;
+    key.proxy = opts.proxy;
+    key.separate = opts.separate_connection;
+
+    pool_.evict_idle();
+    const auto connection = pool_.acquire(key);
+
+    const DWORD flags = (components.nScheme == INTERNET_SCHEME_HTTPS) ? WINHTTP_FLAG_SECURE : 0;
+
+    auto request = ::WinHttpOpenRequest(connection.connection(), verb.c_str(), components.lpszUrlPath, nullptr, nullptr, WINHTTP_DEFAULT_ACCEPT_TYPES, flags);
+    if (!request)
+    {
+        throw win32_error("WinHttpOpenRequest");
+    }
+
+    // Closing the handle is how WinHTTP cancels a synchronous request, the blocking call below fails then.
+    if (opts.cancel && !opts.cancel->attach([request]() { ::WinHttpCloseHandle(request); }))
+    {
+        ::WinHttpCloseHandle(request);
+        throw std::system_error(ERROR_CANCELLED, std::system_category(), "Request cancelled.");
+    }
+
+    const auto request_grd = scoped_cleanup([&request, &opts]()
+        {
+            if (!opts.cancel || opts.cancel->detach())
+            {
+                ::WinHttpCloseHandle(request);
+            }
+        });
+
+    if (!::WinHttpSetTimeouts(request, std::get<0>(opts.timeouts) * 1000,
+                                       std::get<1>(opts.timeouts) * 1000,
+                                       std::get<2>(opts.timeouts) * 1000,
+                                       std::get<3>(opts.timeouts) * 1000))
+    {
+        throw win32_error("WinHttpSetTimeouts");
+    }
+
+    {
+        // Covers resolving, connecting and the TLS handshake when the pooled connection has to be (re)opened.
+        const trace::span span("http send");
+
+        const auto request_headers_str = headers_to_string(headers);
+        if (!::WinHttpSendRequest(request, 
+                                  request_headers_str.empty() ? WINHTTP_NO_ADDITIONAL_HEADERS : request_headers_str.c_str(),
+                                  static_cast<DWORD>(request_headers_str.size()),
+                                  request_body.empty() ? WINHTTP_NO_REQUEST_DATA : const_cast<char *>(request_body.data()),
+                                  static_cast<DWORD>(request_body.size()),
+                                  static_cast<DWORD>(request_body.size()),
+                                  0))
+        {
+            const auto error = ::GetLastError();
+            if (error == ERROR_WINHTTP_CLIENT_AUTH_CERT_NEEDED)
+            {
+                if (!::WinHttpSetOption(request, WINHTTP_OPTION_CLIENT_CERT_CONTEXT, WINHTTP_NO_CLIENT_CERT_CONTEXT, 0))
+                {
+                    return resp;
+                }
+
+                if (!::WinHttpSendRequest(request, WINHTTP_NO_ADDITIONAL_HEADERS, 0, WINHTTP_NO_REQUEST_DATA, 0, 0, 0))
+                {
+                    throw win32_error("WinHttpSendRequest");
+                }
+            }
+            else
+            {
+                throw win32_error("WinHttpSendRequest");
+            }
+        }
+    }
+
+    const trace::span receive_span("http receive");
+
+    if (!::WinHttpReceiveResponse(request, NULL))
+    {
+        throw win32_error("WinHttpReceiveResponse");
+    }
+
+    DWORD protocol = 0;
+    DWORD protocol_size = sizeof(protocol);
+    if (::WinHttpQueryOption(request, WINHTTP_OPTION_HTTP_PROTOCOL_USED, &protocol, &protocol_size))
+    {
+        LOG_DEBUG << (protocol & WINHTTP_PROTOCOL_FLAG_HTTP2 ? L"HTTP/2" : L"HTTP/1.1") << L" response from " << key.host;
+        connection.negotiated((protocol & WINHTTP_PROTOCOL_FLAG_HTTP2) != 0);
+    }
+
+    DWORD status_code = 0;
+    DWORD header_size = sizeof(status_code);
+
+    if (!::WinHttpQueryHeaders(request, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &status_code, &header_size, WINHTTP_NO_HEADER_INDEX))
+    {
+        throw win32_error("WinHttpQueryHeaders");
+    }
+
+    header_map response_headers;
+
+    // Allocate memory for the buffer.
+    if (!::WinHttpQueryHeaders(request, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, nullptr, &header_size, WINHTTP_NO_HEADER_INDEX) &&
+        ::GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        std::wstring headers_str(header_size / sizeof(wchar_t), 0);
+
+        if (!::WinHttpQueryHeaders(request, WINHTTP_QUERY_RAW_HEADERS_CRLF, WINHTTP_HEADER_NAME_BY_INDEX, &headers_str[0], &header_size, WINHTTP_NO_HEADER_INDEX))
+        {
+            throw win32_error("WinHttpQueryHeaders");
+        }
+
+        response_headers = string_to_headers(headers_str);
+    }
+
+    resp.status_code = status_code;
+    resp.headers.swap(response_headers);
+
+    // The body goes straight into one buffer, sized up front when the server announces the length. A sink that takes
+    // the body gets the chunks instead and the buffer is reused for each of them.
+    const bool streaming = opts.sink && opts.sink->begin(resp);
+
+    DWORD content_length = 0;
+    DWORD content_length_size = sizeof(content_length);
+    if (!streaming && ::WinHttpQueryHeaders(request, WINHTTP_QUERY_CONTENT_LENGTH | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &content_length, &content_length_size, WINHTTP_NO_HEADER_INDEX))
+    {
+        resp.body.reserve(content_length);
+    }
+
+    for (;;)
+    {
+        DWORD available = 0;
+        if (!::WinHttpQueryDataAvailable(request, &available))
+        {
+            throw win32_error("WinHttpQueryDataAvailable");
+        }
+
+        if (!available)
+        {
+            break;
+        }
+
+        const auto offset = streaming ? 0 : resp.body.size();
+        resp.body.resize(offset + available);
+
+        DWORD downloaded = 0;
+        if (!::WinHttpReadData(request, &resp.body[offset], available, &downloaded))
+        {
+            // Sometimes WinHttpReadData returns FALSE when no data is available
+            // In such case last error is ERROR_SUCCESS. This is not an error condition.
+            const auto error = ::GetLastError();
+            if (error != ERROR_SUCCESS)
+            {
+                throw win32_error("WinHttpReadData");
+            }
+        }
+
+        resp.body.resize(offset + downloaded);
+
+        if (streaming)
+        {
+            opts.sink->write(resp.body.data(), resp.body.size());
+        }
+    }
+
+    if (streaming)
+    {
+        resp.body.clear();
+    }
+
+    return resp;
+}
+
+transport::header_map winhttp_transport::string_to_headers(const std::wstring& str) const
+{
+    header_map headers;
+    headers.reserve(static_cast<std::size_t>(std::count(str.begin(), str.end(), L'\n')));
+
+    // 1st line is http status, skip it.
+    auto line = str.find(L"\r\n");
+    while (line != str.npos)
+    {
+        line += 2;
+        auto end = str.find(L"\r\n", line);
+        if (end == str.npos)
+        {
+            end = str.size();
+        }
+
+        auto delim_pos = str.find(L':', line);
+        if (delim_pos < end)
+        {
+            auto value_pos = delim_pos + 1;
+            while (value_pos < end && (str[value_pos] == L' ' || str[value_pos] == L'\t'))
+            {
+                ++value_pos;
+            }
+            headers.emplace(str.substr(line, delim_pos - line), str.substr(value_pos, end - value_pos));
+        }
+
+        line = end < str.size() ? end : str.npos;
+    }
+    return headers;
+}
+
+std::wstring winhttp_transport::headers_to_string(const header_map& headers) const
+{
+    // Sized up front and written in place, instead of joining a temporary string per header.
+    std::size_t size = 0;
+    for (const auto& header : headers)
+    {
+        size += header.first.size() + header.second.size() + 4;
+    }
+
+    std::wstring str;
+    str.reserve(size);
+    for (const auto& header : headers)
+    {
+        if (!str.empty())
+        {
+            str += L"\r\n";
+        }
+        str += header.first;
+        str += L": ";
+        str += header.second;
+    }
+    return str;
+}
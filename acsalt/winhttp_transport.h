@@ -0,0 +1,17 @@
+#pragma once
+
+#include "connection_pool.h"
+#include "transport.h"
+
+class winhttp_transport : public transport
+{
+public:
+    response send(const std::wstring& url, const std::wstring& verb, const std::string& request_body, const header_map& headers, const options& opts) override;
+
+private:
+    header_map string_to_headers(const std::wstring& str) const;
+
+    std::wstring headers_to_string(const header_map& headers) const;
+
+    connection_pool pool_;
+};